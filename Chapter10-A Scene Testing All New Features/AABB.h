@@ -13,6 +13,55 @@ class AABB
 
         bool Hit(const Ray& InRay, float tMin, float tMax) const;
 
+        // Box containing nothing, growing it with anything gives that thing's box.
+        static AABB Empty()
+        {
+            return AABB(Point3(Infinity, Infinity, Infinity), Point3(-Infinity, -Infinity, -Infinity));
+        }
+
+        inline bool IsEmpty() const
+        {
+            return Minimum.X() > Maximum.X() || Minimum.Y() > Maximum.Y() || Minimum.Z() > Maximum.Z();
+        }
+
+        inline void Expand(const Point3& p)
+        {
+            for (int i = 0; i < 3; i++)
+            {
+                Minimum[i] = Minimum[i] < p[i] ? Minimum[i] : p[i];
+                Maximum[i] = Maximum[i] > p[i] ? Maximum[i] : p[i];
+            }
+        }
+
+        inline void Expand(const AABB& Box)
+        {
+            for (int i = 0; i < 3; i++)
+            {
+                Minimum[i] = Minimum[i] < Box.Minimum[i] ? Minimum[i] : Box.Minimum[i];
+                Maximum[i] = Maximum[i] > Box.Maximum[i] ? Maximum[i] : Box.Maximum[i];
+            }
+        }
+
+        inline Point3 Centroid() const { return 0.5f * (Minimum + Maximum); }
+        inline Vector3 Extent() const { return Maximum - Minimum; }
+
+        inline float SurfaceArea() const
+        {
+            if (IsEmpty())
+            {
+                return 0.0f;
+            }
+            Vector3 d = Extent();
+            return 2.0f * (d.X() * d.Y() + d.Y() * d.Z() + d.Z() * d.X());
+        }
+
+        // Axis of the largest extent
+        inline int MaxAxis() const
+        {
+            Vector3 d = Extent();
+            return d.X() > d.Y() && d.X() > d.Z() ? 0 : (d.Y() > d.Z() ? 1 : 2);
+        }
+
         Point3 Minimum;
         Point3 Maximum;
 };
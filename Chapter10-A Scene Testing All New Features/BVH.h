@@ -1,7 +1,8 @@
 #pragma once
 
-#include "RTWeekEnd.h"
+#include "RTWeekend.h"
 
+#include "BVHBuilders.h"
 #include "Hittable.h"
 #include "HittableList.h"
 
@@ -10,113 +11,138 @@ class BVHNode : public Hittable
     public:
         BVHNode();
 
-        BVHNode(const HittableList& List, float Time0, float Time1)
-            : BVHNode(List.Objects, 0, List.Objects.size(), Time0, Time1)
+        BVHNode(const HittableList& List, float Time0, float Time1, const BVHBuildOptions& Options = BVHBuildOptions())
+            : BVHNode(List.Objects, 0, List.Objects.size(), Time0, Time1, Options)
         {}
 
+        /// Options.MaxLeafSize is ignored, every leaf is a single object.
         BVHNode(
             const std::vector<shared_ptr<Hittable>>& SrcObjects,
-            size_t Start, size_t End, float Time0, float Time1);
+            size_t Start, size_t End, float Time0, float Time1,
+            const BVHBuildOptions& Options = BVHBuildOptions());
+
+        /// Node of an already built tree. Objects[Start + i] is primitive i of the build.
+        BVHNode(
+            const BVHBuildResult& Build, uint32_t NodeIndex,
+            const std::vector<shared_ptr<Hittable>>& Objects, size_t Start);
 
         virtual bool Hit(const Ray& InRay, float tMin, float tMax, HitRecord& Record) const override;
 
         virtual bool BoundingBox(float InTime0, float InTime1, AABB& OutputBox) const override;
 
+        /// Every node of the tree with the reference counts make_shared allocates
+        /// along, not the primitives the leaves point to.
+        size_t GetMemoryBytes() const;
+
+    private:
+        static shared_ptr<Hittable> MakeChild(
+            const BVHBuildResult& Build, uint32_t NodeIndex,
+            const std::vector<shared_ptr<Hittable>>& Objects, size_t Start);
+
     public:
         shared_ptr<Hittable> Left;
         shared_ptr<Hittable> Right;
         AABB Box;
+        int SplitAxis = 0;
 };
 
-inline bool BoxCompare(const shared_ptr<Hittable> a, const shared_ptr<Hittable> b, int Axis) {
-    AABB BoxA;
-    AABB BoxB;
+BVHNode::BVHNode(
+    const std::vector<shared_ptr<Hittable>>& SrcObjects,
+    size_t Start, size_t End, float Time0, float Time1,
+    const BVHBuildOptions& Options)
+{
+    // The builder only sees the bounds, the objects are never copied or sorted
+    std::vector<AABB> PrimitiveBounds;
+    CollectPrimitiveBounds(SrcObjects, Start, End, Time0, Time1, PrimitiveBounds, Options.bParallel);
+
+    BVHBuildOptions NodeOptions = Options;
+    NodeOptions.MaxLeafSize = 1;
+    BVHBuildResult Build = BuildBVH(PrimitiveBounds, NodeOptions);
 
-    if (!a->BoundingBox(0.0f, 0.0f, BoxA) || !b->BoundingBox(0.0f, 0.0f, BoxB))
+    if (Build.IsEmpty())
     {
-        std::cerr << "No bounding box in BVHNode constructor.\n";
+        std::cerr << "No object in BVHNode constructor.\n";
+        return;
     }
-        
-    return BoxA.Min().Elements[Axis] < BoxB.Min().Elements[Axis];
-}
 
+    const BVHBuildNode& Root = Build.Nodes[0];
+    Box = Root.Bounds;
+    SplitAxis = Root.SplitAxis;
 
-bool Box_X_Compare (const shared_ptr<Hittable> a, const shared_ptr<Hittable> b) {
-    return BoxCompare(a, b, 0);
-}
-
-bool Box_Y_Compare (const shared_ptr<Hittable> a, const shared_ptr<Hittable> b) {
-    return BoxCompare(a, b, 1);
+    if (Root.IsLeaf())
+    {
+        Left = Right = SrcObjects[Start + Build.PrimitiveIndices[Root.PrimitivesOffset]];
+    }
+    else
+    {
+        Left = MakeChild(Build, Root.Children[0], SrcObjects, Start);
+        Right = MakeChild(Build, Root.Children[1], SrcObjects, Start);
+    }
 }
 
-bool Box_Z_Compare (const shared_ptr<Hittable> a, const shared_ptr<Hittable> b) {
-    return BoxCompare(a, b, 2);
+BVHNode::BVHNode(const BVHBuildResult& Build, uint32_t NodeIndex, const std::vector<shared_ptr<Hittable>>& Objects, size_t Start)
+{
+    const BVHBuildNode& Node = Build.Nodes[NodeIndex];
+    Box = Node.Bounds;
+    SplitAxis = Node.SplitAxis;
+    Left = MakeChild(Build, Node.Children[0], Objects, Start);
+    Right = MakeChild(Build, Node.Children[1], Objects, Start);
 }
 
-BVHNode::BVHNode(const std::vector<shared_ptr<Hittable>>& SrcObjects, size_t Start, size_t End, float Time0, float Time1)
+shared_ptr<Hittable> BVHNode::MakeChild(const BVHBuildResult& Build, uint32_t NodeIndex, const std::vector<shared_ptr<Hittable>>& Objects, size_t Start)
 {
-    auto Objects = SrcObjects; // Create a modifiable array of the source scene objects
+    const BVHBuildNode& Node = Build.Nodes[NodeIndex];
 
-    int Axis = RandomInt(0, 2);
-    auto Comparator = (Axis == 0) ? Box_X_Compare
-                    : (Axis == 1) ? Box_Y_Compare
-                                  : Box_Z_Compare;
-
-    size_t ObjectSpan = End - Start;
-
-    if (ObjectSpan == 1) 
-    {
-        Left = Right = Objects[Start];
-    } 
-    else if (ObjectSpan == 2) 
-    {
-        if (Comparator(Objects[Start], Objects[Start + 1])) 
-        {
-            Left = Objects[Start];
-            Right = Objects[Start + 1];
-        } 
-        else 
-        {
-            Left = Objects[Start + 1];
-            Right = Objects[Start];
-        }
-    } 
-    else 
+    // Leaves hold a single primitive, which is hit directly
+    if (Node.IsLeaf())
     {
-        std::sort(Objects.begin() + Start, Objects.begin() + End, Comparator);
-
-        auto Mid = Start + ObjectSpan / 2;
-        Left = make_shared<BVHNode>(Objects, Start, Mid, Time0, Time1);
-        Right = make_shared<BVHNode>(Objects, Mid, End, Time0, Time1);
+        return Objects[Start + Build.PrimitiveIndices[Node.PrimitivesOffset]];
     }
 
-    AABB BoxLeft, BoxRight;
-
-    if (  !Left->BoundingBox(Time0, Time1, BoxLeft)
-       || !Right->BoundingBox(Time0, Time1, BoxRight)
-    )
-    {
-        std::cerr << "No bounding box in BVHNode constructor.\n";
-    }
-        
-    Box = SurroundingBox(BoxLeft, BoxRight);
+    return make_shared<BVHNode>(Build, NodeIndex, Objects, Start);
 }
 
 bool BVHNode::Hit(const Ray& InRay, float tMin, float tMax, HitRecord& Record) const
 {
+    RT_BVH_STAT(CountNodes(1));
+    RT_BVH_STAT(CountBoxes(1));
     if(!Box.Hit(InRay, tMin, tMax))
     {
         return false;
     }
 
-    bool bHitLeft = Left->Hit(InRay, tMin, tMax, Record);
-    bool bHitRight = Right->Hit(InRay, tMin, tMax, Record);
+    // Nearer child first, the farther one is only searched up to the closest hit
+    const bool bRightFirst = InRay.GetDirection()[SplitAxis] < 0.0f;
+    const shared_ptr<Hittable>& Near = bRightFirst ? Right : Left;
+    const shared_ptr<Hittable>& Far = bRightFirst ? Left : Right;
+
+#if defined(RT_BVH_STATS)
+    // Children other than nodes are the primitives of a leaf
+    const bool bNearIsPrimitive = dynamic_cast<const BVHNode*>(Near.get()) == nullptr;
+    const bool bFarIsPrimitive = Far != Near && dynamic_cast<const BVHNode*>(Far.get()) == nullptr;
+    RT_BVH_STAT(CountPrimitives(bNearIsPrimitive + bFarIsPrimitive));
+#endif
 
-    return bHitLeft || bHitRight;
+    bool bHitNear = Near->Hit(InRay, tMin, tMax, Record);
+    bool bHitFar = Far != Near && Far->Hit(InRay, tMin, bHitNear ? Record.t : tMax, Record);
+
+    return bHitNear || bHitFar;
 }
 
 bool BVHNode::BoundingBox(float InTime0, float InTime1, AABB& OutputBox) const 
 {
     OutputBox = Box;
     return true;
-}
\ No newline at end of file
+}
+
+size_t BVHNode::GetMemoryBytes() const
+{
+    // Virtual table pointer, use and weak counts of the control block
+    size_t Bytes = sizeof(BVHNode) + sizeof(void*) + 2 * sizeof(int);
+
+    const BVHNode* LeftNode = dynamic_cast<const BVHNode*>(Left.get());
+    const BVHNode* RightNode = dynamic_cast<const BVHNode*>(Right.get());
+    Bytes += LeftNode ? LeftNode->GetMemoryBytes() : 0;
+    Bytes += RightNode && Right != Left ? RightNode->GetMemoryBytes() : 0;
+    return Bytes;
+}
@@ -0,0 +1,310 @@
+#pragma once
+
+#include "RTWeekend.h"
+
+#include "BVH.h"
+#include "BVHStats.h"
+#include "CompressedBVH.h"
+#include "HittableList.h"
+#include "LinearBVH.h"
+#include "Material.h"
+#include "Sphere.h"
+#include "WideBVH.h"
+
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+/// Set associative LRU cache, counts the misses of the addresses it is given.
+/// Used to compare node layouts independently of the machine running the benchmark.
+class CacheSimulator
+{
+    public:
+        CacheSimulator(size_t InBytes, size_t InLineBytes, int InWays)
+            : LineBytes(InLineBytes)
+            , Ways(InWays)
+            , SetsNum(std::max<size_t>(InBytes / (InLineBytes * InWays), 1))
+            , Tags(SetsNum * InWays, ~uint64_t(0))
+        {}
+
+        inline void Access(const void* Address)
+        {
+            const uint64_t Line = reinterpret_cast<uintptr_t>(Address) / LineBytes;
+            uint64_t* Set = &Tags[(Line % SetsNum) * Ways];
+            Accesses++;
+
+            // Ways ordered most recent first
+            int Way = 0;
+            while (Way < Ways && Set[Way] != Line)
+            {
+                ++Way;
+            }
+            if (Way == Ways)
+            {
+                Misses++;
+                Way = Ways - 1;
+            }
+            for (; Way > 0; --Way)
+            {
+                Set[Way] = Set[Way - 1];
+            }
+            Set[0] = Line;
+        }
+
+        inline uint64_t GetMisses() const { return Misses; }
+        inline uint64_t GetAccesses() const { return Accesses; }
+
+    private:
+        size_t LineBytes;
+        int Ways;
+        size_t SetsNum;
+        std::vector<uint64_t> Tags;
+        uint64_t Misses = 0;
+        uint64_t Accesses = 0;
+};
+
+/// Compares the acceleration structures on the same random sphere cloud and the
+/// same incoherent rays (random origins in the cloud, random directions), one
+/// thread. The hit count and the sum of the hit distances must agree, the memory
+/// per primitive counts the structure itself, not the spheres. Built with
+/// RT_BVH_STATS, the work per ray of every structure is shown too.
+class BVHBenchmark
+{
+    public:
+        BVHBenchmark(uint32_t InPrimitiveNums, uint32_t InRayNums = 1000000);
+
+        void Run(std::ostream& Out);
+
+    private:
+        struct Result
+        {
+            double BuildSeconds = 0.0;
+            double TraceSeconds = 0.0;
+            uint32_t Hits = 0;
+            double tSum = 0.0;
+            size_t MemoryBytes = 0;
+            BVHRayCounters Traversal;
+        };
+
+        /// Build returns a shared_ptr to the structure, which has a GetMemoryBytes().
+        template<typename BuildFunctor>
+        Result Measure(const BuildFunctor& Build) const;
+
+        void PrintRow(std::ostream& Out, const char* Name, const Result& Measured) const;
+
+        /// Move the spheres a little, frame after frame, and compare refitting with rebuilding.
+        void RunRefit(std::ostream& Out);
+
+        /// Node fetches missing a simulated L1, L2 and TLB for every LinearBVH node layout.
+        void RunLayouts(std::ostream& Out);
+
+        Result Trace(const Hittable& Structure) const;
+
+        inline double RayNumsPerSecond(const Result& Measured) const { return Rays.size() / Measured.TraceSeconds * 1e-6; }
+
+    private:
+        HittableList Cloud;
+        std::vector<shared_ptr<Sphere>> Spheres;
+        std::vector<Ray> Rays;
+};
+
+BVHBenchmark::BVHBenchmark(uint32_t InPrimitiveNums, uint32_t InRayNums)
+{
+    const float Size = 100.0f;
+    const float Radius = 0.25f * Size / std::cbrt(static_cast<float>(std::max(InPrimitiveNums, 1u)));
+
+    BeginRandomSample(0, 0);
+    auto White = make_shared<Lambertian>(Color(0.73f, 0.73f, 0.73f));
+    for (uint32_t i = 0; i < InPrimitiveNums; ++i)
+    {
+        Spheres.push_back(make_shared<Sphere>(Point3::Random(0.0f, Size), Radius * RandomFloat(0.5f, 1.5f), White));
+        Cloud.Add(Spheres.back());
+    }
+
+    Rays.reserve(InRayNums);
+    for (uint32_t i = 0; i < InRayNums; ++i)
+    {
+        Rays.emplace_back(Point3::Random(0.0f, Size), RandomUnitVector(), 0.0f);
+    }
+}
+
+template<typename BuildFunctor>
+BVHBenchmark::Result BVHBenchmark::Measure(const BuildFunctor& Build) const
+{
+    Result Measured;
+
+    auto BuildStart = std::chrono::steady_clock::now();
+    auto Structure = Build();
+    auto BuildEnd = std::chrono::steady_clock::now();
+
+    Measured = Trace(*Structure);
+    Measured.BuildSeconds = std::chrono::duration<double>(BuildEnd - BuildStart).count();
+    Measured.MemoryBytes = Structure->GetMemoryBytes();
+    return Measured;
+}
+
+BVHBenchmark::Result BVHBenchmark::Trace(const Hittable& Structure) const
+{
+    Result Measured;
+    RT_BVH_STAT(Reset());
+    auto TraceStart = std::chrono::steady_clock::now();
+
+    HitRecord Record;
+    for (const Ray& BenchRay : Rays)
+    {
+        RT_BVH_STAT(BeginRay(true));
+        if (Structure.Hit(BenchRay, 0.001f, Infinity, Record))
+        {
+            Measured.Hits++;
+            Measured.tSum += Record.t;
+        }
+    }
+
+    Measured.TraceSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - TraceStart).count();
+#if defined(RT_BVH_STATS)
+    Measured.Traversal = BVHTraversalStats::GetTotal(BVHTraversalStats::Primary);
+#endif
+    return Measured;
+}
+
+void BVHBenchmark::PrintRow(std::ostream& Out, const char* Name, const Result& Measured) const
+{
+    Out << std::left << std::setw(14) << Name << std::right
+        << std::setw(12) << std::fixed << std::setprecision(3) << Measured.BuildSeconds * 1000.0
+        << std::setw(12) << std::setprecision(2) << RayNumsPerSecond(Measured)
+        << std::setw(12) << std::setprecision(1) << static_cast<double>(Measured.MemoryBytes) / std::max<size_t>(Spheres.size(), 1)
+        << std::setw(12) << Measured.Hits
+        << std::setw(16) << std::setprecision(3) << Measured.tSum;
+#if defined(RT_BVH_STATS)
+    const double RaysNum = static_cast<double>(std::max<uint64_t>(Measured.Traversal.Rays, 1));
+    Out << std::setw(12) << std::setprecision(2) << Measured.Traversal.NodesVisited / RaysNum
+        << std::setw(12) << Measured.Traversal.BoxesTested / RaysNum
+        << std::setw(12) << Measured.Traversal.PrimitivesTested / RaysNum;
+#endif
+    Out << '\n';
+}
+
+void BVHBenchmark::Run(std::ostream& Out)
+{
+    Out << "BVH benchmark: " << Cloud.Objects.size() << " spheres, " << Rays.size() << " rays\n";
+    Out << std::left << std::setw(14) << "Structure" << std::right
+        << std::setw(12) << "Build (ms)" << std::setw(12) << "MRays/s" << std::setw(12) << "Bytes/prim"
+        << std::setw(12) << "Hits" << std::setw(16) << "Sum of t";
+#if defined(RT_BVH_STATS)
+    Out << std::setw(12) << "Nodes/ray" << std::setw(12) << "Boxes/ray" << std::setw(12) << "Prims/ray";
+#endif
+    Out << '\n';
+
+    const std::ios::fmtflags Flags = Out.flags();
+    const std::streamsize Precision = Out.precision();
+
+    PrintRow(Out, "BVHNode", Measure([this]() { return make_shared<BVHNode>(Cloud, 0.0f, 1.0f); }));
+    PrintRow(Out, "LinearBVH", Measure([this]() { return make_shared<LinearBVH>(Cloud, 0.0f, 1.0f); }));
+    PrintRow(Out, "QBVH", Measure([this]() { return make_shared<QBVH>(Cloud, 0.0f, 1.0f); }));
+    PrintRow(Out, "OBVH", Measure([this]() { return make_shared<OBVH>(Cloud, 0.0f, 1.0f); }));
+    PrintRow(Out, "CompressedBVH", Measure([this]() { return make_shared<CompressedBVH>(Cloud, 0.0f, 1.0f); }));
+
+    // Same layout, faster builders
+    BVHBuildOptions Options;
+    Options.Method = BVHBuildMethod::LBVH;
+    PrintRow(Out, "Linear/LBVH", Measure([this, &Options]() { return make_shared<LinearBVH>(Cloud, 0.0f, 1.0f, Options); }));
+    Options.Method = BVHBuildMethod::HLBVH;
+    PrintRow(Out, "Linear/HLBVH", Measure([this, &Options]() { return make_shared<LinearBVH>(Cloud, 0.0f, 1.0f, Options); }));
+    Options.Method = BVHBuildMethod::SBVH;
+    PrintRow(Out, "Linear/SBVH", Measure([this, &Options]() { return make_shared<LinearBVH>(Cloud, 0.0f, 1.0f, Options); }));
+
+    RunLayouts(Out);
+    RunRefit(Out);
+
+    Out.flags(Flags);
+    Out.precision(Precision);
+}
+
+void BVHBenchmark::RunRefit(std::ostream& Out)
+{
+    const int FramesNum = 8;
+    const float Step = 0.5f * Spheres[0]->Radius;
+
+    LinearBVH Refitted(Cloud, 0.0f, 1.0f);
+    Out << "\nRefit, spheres moving by up to " << Step << " per frame\n";
+
+    BeginRandomSample(1, 0);
+    for (int Frame = 1; Frame <= FramesNum; ++Frame)
+    {
+        for (const shared_ptr<Sphere>& Moving : Spheres)
+        {
+            Moving->Origin += Step * RandomInUnitSphere();
+        }
+
+        auto RefitStart = std::chrono::steady_clock::now();
+        bool bRefitted = Refitted.Refit(0.0f, 1.0f);
+        auto RefitEnd = std::chrono::steady_clock::now();
+        LinearBVH Rebuilt(Cloud, 0.0f, 1.0f);
+        auto RebuildEnd = std::chrono::steady_clock::now();
+
+        Result RefitTrace = Trace(Refitted);
+        Result RebuildTrace = Trace(Rebuilt);
+
+        Out << "Frame " << Frame << (bRefitted ? ": refit " : ": rebuilt ")
+            << std::setprecision(3) << std::chrono::duration<double>(RefitEnd - RefitStart).count() * 1000.0 << " ms"
+            << " (rebuild " << std::chrono::duration<double>(RebuildEnd - RefitEnd).count() * 1000.0 << " ms)"
+            << ", SAH " << Refitted.GetSAHCost() << " vs " << Rebuilt.GetSAHCost()
+            << ", " << std::setprecision(2) << RayNumsPerSecond(RefitTrace) << " vs " << RayNumsPerSecond(RebuildTrace) << " MRays/s"
+            << (RefitTrace.Hits == RebuildTrace.Hits && RefitTrace.tSum == RebuildTrace.tSum ? "" : ", MISMATCH") << '\n';
+    }
+}
+
+void BVHBenchmark::RunLayouts(std::ostream& Out)
+{
+    struct LayoutCase
+    {
+        const char* Name;
+        BVHNodeLayout Layout;
+        int TreeletBytes;
+    };
+    const LayoutCase Cases[] = {
+        { "Depth first", BVHNodeLayout::DepthFirst, 0 },
+        { "Treelets 1K", BVHNodeLayout::Treelets, 1024 },
+        { "Treelets 4K", BVHNodeLayout::Treelets, 4096 },
+    };
+
+    Out << "\nLinearBVH node layouts, simulated misses per ray (32 KiB L1, 1 MiB L2, 64 pages TLB)\n";
+    Out << std::left << std::setw(14) << "Layout" << std::right
+        << std::setw(12) << "Nodes/ray" << std::setw(12) << "L1" << std::setw(12) << "L2"
+        << std::setw(12) << "TLB" << std::setw(12) << "MRays/s" << '\n';
+
+    for (const LayoutCase& Case : Cases)
+    {
+        BVHBuildOptions Options;
+        Options.Layout = Case.Layout;
+        Options.TreeletBytes = Case.TreeletBytes;
+        LinearBVH Structure(Cloud, 0.0f, 1.0f, Options);
+
+        CacheSimulator L1(32 * 1024, 64, 8);
+        CacheSimulator L2(1024 * 1024, 64, 16);
+        CacheSimulator TLB(64 * 4096, 4096, 64);
+        const LinearBVHNode* Nodes = Structure.GetNodes();
+        auto OnNodeFetch = [&](int32_t Index)
+        {
+            L1.Access(Nodes + Index);
+            L2.Access(Nodes + Index);
+            TLB.Access(Nodes + Index);
+        };
+
+        HitRecord Record;
+        for (const Ray& BenchRay : Rays)
+        {
+            Structure.HitTraced(BenchRay, 0.001f, Infinity, Record, OnNodeFetch);
+        }
+
+        const double RayNums = static_cast<double>(Rays.size());
+        Out << std::left << std::setw(14) << Case.Name << std::right << std::fixed << std::setprecision(2)
+            << std::setw(12) << L1.GetAccesses() / RayNums
+            << std::setw(12) << L1.GetMisses() / RayNums
+            << std::setw(12) << L2.GetMisses() / RayNums
+            << std::setw(12) << TLB.GetMisses() / RayNums
+            << std::setw(12) << RayNumsPerSecond(Trace(Structure)) << '\n';
+    }
+}
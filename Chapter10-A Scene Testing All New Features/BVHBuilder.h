@@ -0,0 +1,589 @@
+#pragma once
+
+#include "RTWeekend.h"
+
+#include "AABB.h"
+#include "Hittable.h"
+#include "ParallelFor.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum class BVHBuildMethod
+{
+    // Binned SAH, best trees
+    BinnedSAH,
+    // Morton code sort, fastest build
+    LBVH,
+    // Morton clusters with SAH over the top levels, in between
+    HLBVH,
+    // Binned SAH with spatial splits, slowest build, for large overlapping primitives
+    SBVH
+};
+
+// Order of the nodes in the arrays of the flat BVHs
+enum class BVHNodeLayout
+{
+    // Depth first, every sibling pair in one cache line
+    DepthFirst,
+    // Treelets of TreeletBytes filled by likeliest traversal first (largest area),
+    // so most steps of a ray stay in memory pages already touched
+    Treelets
+};
+
+struct BVHBuildOptions
+{
+    BVHBuildMethod Method = BVHBuildMethod::BinnedSAH;
+
+    // Leaves hold at most this many primitives
+    int MaxLeafSize = 4;
+    // Buckets the centroids are binned into along each axis
+    int BinsNum = 16;
+    // Surface Area Heuristic costs, relative to each other
+    float TraversalCost = 1.0f;
+    float IntersectionCost = 1.0f;
+
+    // Build on the shared ThreadPool
+    bool bParallel = true;
+    // Nodes with at least this many primitives bin and partition them in
+    // chunks of ParallelChunkSize, one task per chunk
+    uint32_t ParallelNodeSize = 16384;
+    uint32_t ParallelChunkSize = 4096;
+    // Subtrees with at least this many primitives are built as their own task
+    uint32_t SubtreeTaskSize = 1024;
+
+    // LBVH and HLBVH: Morton code precision, 30 (10 bits per axis) or 63 (21 bits per axis)
+    int MortonBits = 30;
+
+    // SBVH: spatial splits are tried where the object split children overlap by
+    // more than this fraction of the root area
+    float SpatialSplitAlpha = 1e-5f;
+    // SBVH: extra primitive references allowed, relative to the primitive count
+    float MaxDuplication = 0.5f;
+
+    // Refitted trees are rebuilt once their SAH cost exceeds this ratio of the cost after the build
+    float RefitRebuildRatio = 1.5f;
+
+    // MotionBVH: the shutter interval is halved where the interpolated boxes mid-shutter are
+    // this much bigger than the actual ones, at most MaxTimeSplits times
+    float TimeSplitThreshold = 1.5f;
+    int MaxTimeSplits = 2;
+
+    // LinearBVH: node order in memory, and treelet size for BVHNodeLayout::Treelets
+    BVHNodeLayout Layout = BVHNodeLayout::DepthFirst;
+    int TreeletBytes = 4096;
+
+    // LinearBVH: directory of the trees cached between runs, keyed by the scene content.
+    // Empty for none
+    std::string CacheDirectory;
+
+    // Print the quality of every tree built, see BVHBuildStats
+    bool bReportStats = false;
+};
+
+// Node of the tree produced by the builders. Interior nodes have two children,
+// leaves reference PrimitiveCount entries of BVHBuildResult::PrimitiveIndices.
+struct BVHBuildNode
+{
+    AABB Bounds;
+    uint32_t Children[2] = { 0, 0 };
+    uint32_t PrimitivesOffset = 0;
+    uint32_t PrimitiveCount = 0;
+    int SplitAxis = 0;
+
+    inline bool IsLeaf() const { return PrimitiveCount > 0; }
+};
+
+struct BVHBuildResult
+{
+    // Nodes[0] is the root
+    std::vector<BVHBuildNode> Nodes;
+    // Primitives in leaf order, leaves point at ranges of this array
+    std::vector<uint32_t> PrimitiveIndices;
+
+    inline bool IsEmpty() const { return Nodes.empty(); }
+};
+
+/// Bounds of every object over [Time0, Time1].
+void CollectPrimitiveBounds(
+    const std::vector<shared_ptr<Hittable>>& Objects, size_t Start, size_t End,
+    float Time0, float Time1, std::vector<AABB>& OutBounds, bool bParallel = true)
+{
+    OutBounds.resize(End - Start);
+    ParallelFor(static_cast<uint32_t>(End - Start), [&](int First, int Last)
+    {
+        for (int i = First; i < Last; ++i)
+        {
+            if (!Objects[Start + i]->BoundingBox(Time0, Time1, OutBounds[i]))
+            {
+                std::cerr << "No bounding box in BVH constructor.\n";
+                OutBounds[i] = AABB(Point3(0.0f, 0.0f, 0.0f), Point3(0.0f, 0.0f, 0.0f));
+            }
+        }
+    }, bParallel && End - Start >= 1024);
+}
+
+/// Calls Functor(ChunkIndex, ChunkBegin, ChunkEnd) on every ChunkSize chunk of
+/// [Begin, End), one task per chunk when bParallel. Returns the number of chunks.
+template<typename FunctorType>
+uint32_t ForEachBuildChunk(uint32_t Begin, uint32_t End, uint32_t ChunkSize, bool bParallel, const FunctorType& Functor)
+{
+    const uint32_t ChunksNum = (End - Begin + ChunkSize - 1) / ChunkSize;
+
+    if (!bParallel || ChunksNum <= 1)
+    {
+        for (uint32_t c = 0; c < ChunksNum; ++c)
+        {
+            Functor(c, Begin + c * ChunkSize, std::min(End, Begin + (c + 1) * ChunkSize));
+        }
+        return ChunksNum;
+    }
+
+    TaskGroup Group;
+    for (uint32_t c = 0; c < ChunksNum; ++c)
+    {
+        uint32_t ChunkBegin = Begin + c * ChunkSize;
+        uint32_t ChunkEnd = std::min(End, ChunkBegin + ChunkSize);
+        Group.Run([&Functor, c, ChunkBegin, ChunkEnd]()
+        {
+            Functor(c, ChunkBegin, ChunkEnd);
+        });
+    }
+    Group.Wait();
+
+    return ChunksNum;
+}
+
+/// Binned Surface Area Heuristic builder. It works on an index array with the
+/// primitive bounds and centroids cached up front, so the objects themselves
+/// are never touched or copied while building.
+///
+/// The build runs on the shared ThreadPool: large subtrees become tasks and the
+/// biggest nodes (near the root, where the recursion alone has no parallelism)
+/// bin and partition their primitives in chunks. Chunks only depend on the node
+/// size, so the tree does not depend on the number of workers.
+class BVHBuilder
+{
+    public:
+        BVHBuilder(const std::vector<AABB>& InPrimitiveBounds, const BVHBuildOptions& InOptions = BVHBuildOptions());
+
+        BVHBuildResult Build();
+
+        /// SAH cost of a built tree, relative to the root surface area.
+        static float ComputeSAHCost(const BVHBuildResult& Result, const BVHBuildOptions& Options = BVHBuildOptions());
+
+    private:
+        struct Bin
+        {
+            AABB Bounds = AABB::Empty();
+            uint32_t Count = 0;
+        };
+
+        struct Split
+        {
+            int Axis = -1;
+            int BinIndex = 0;
+            float Cost = Infinity;
+        };
+
+        void BuildNode(uint32_t NodeIndex, uint32_t Begin, uint32_t End);
+
+        void ComputeBounds(uint32_t Begin, uint32_t End, AABB& OutNodeBounds, AABB& OutCentroidBounds) const;
+
+        /// Bins of the 3 axes, Bins[Axis * BinsNum + b].
+        void BinPrimitives(uint32_t Begin, uint32_t End, const AABB& CentroidBounds, std::vector<Bin>& OutBins) const;
+
+        Split FindBestSplit(uint32_t Begin, uint32_t End, const AABB& CentroidBounds, const AABB& NodeBounds) const;
+
+        /// Move the primitives left of the split first, returns where the right side starts.
+        uint32_t Partition(uint32_t Begin, uint32_t End, const Split& InSplit, const AABB& CentroidBounds);
+
+        inline bool IsLeftOf(uint32_t Index, const Split& InSplit, const AABB& CentroidBounds) const
+        {
+            return BinIndex(Centroids[Index], InSplit.Axis, CentroidBounds) <= InSplit.BinIndex;
+        }
+
+        template<typename FunctorType>
+        inline uint32_t ForEachChunk(uint32_t Begin, uint32_t End, const FunctorType& Functor) const
+        {
+            return ForEachBuildChunk(Begin, End, Options.ParallelChunkSize, Options.bParallel, Functor);
+        }
+
+        inline bool IsParallelNode(uint32_t Count) const
+        {
+            return Count >= Options.ParallelNodeSize;
+        }
+
+        inline int BinIndex(const Point3& Centroid, int Axis, const AABB& CentroidBounds) const
+        {
+            float Extent = CentroidBounds.Max()[Axis] - CentroidBounds.Min()[Axis];
+            int Index = static_cast<int>(Options.BinsNum * (Centroid[Axis] - CentroidBounds.Min()[Axis]) / Extent);
+            return std::min(std::max(Index, 0), Options.BinsNum - 1);
+        }
+
+        /// Index of the first of two consecutive nodes, can be called from any task.
+        inline uint32_t AllocateNodePair() { return NodesNum.fetch_add(2, std::memory_order_relaxed); }
+
+    private:
+        const std::vector<AABB>& PrimitiveBounds;
+        std::vector<Point3> Centroids;
+        BVHBuildOptions Options;
+
+        BVHBuildResult Result;
+        std::atomic<uint32_t> NodesNum;
+        // Destination of the parallel partition
+        std::vector<uint32_t> Scratch;
+};
+
+BVHBuilder::BVHBuilder(const std::vector<AABB>& InPrimitiveBounds, const BVHBuildOptions& InOptions)
+    : PrimitiveBounds(InPrimitiveBounds)
+    , Options(InOptions)
+    , NodesNum(0)
+{
+    Options.MaxLeafSize = std::max(Options.MaxLeafSize, 1);
+    Options.BinsNum = std::max(Options.BinsNum, 2);
+    Options.ParallelChunkSize = std::max(Options.ParallelChunkSize, 1u);
+
+    Centroids.resize(PrimitiveBounds.size());
+    ParallelFor(static_cast<uint32_t>(PrimitiveBounds.size()), [this](int First, int Last)
+    {
+        for (int i = First; i < Last; ++i)
+        {
+            Centroids[i] = PrimitiveBounds[i].Centroid();
+        }
+    }, Options.bParallel && IsParallelNode(static_cast<uint32_t>(PrimitiveBounds.size())));
+}
+
+BVHBuildResult BVHBuilder::Build()
+{
+    Result = BVHBuildResult();
+
+    const uint32_t PrimitiveNums = static_cast<uint32_t>(PrimitiveBounds.size());
+    if (PrimitiveNums == 0)
+    {
+        return Result;
+    }
+
+    Result.PrimitiveIndices.resize(PrimitiveNums);
+    for (uint32_t i = 0; i < PrimitiveNums; ++i)
+    {
+        Result.PrimitiveIndices[i] = i;
+    }
+
+    if (IsParallelNode(PrimitiveNums))
+    {
+        Scratch.resize(PrimitiveNums);
+    }
+
+    // A binary tree over n primitives never has more than 2n - 1 nodes. They are
+    // all allocated up front so tasks can fill their own nodes concurrently.
+    Result.Nodes.resize(2 * PrimitiveNums - 1);
+    NodesNum.store(1, std::memory_order_relaxed);
+    BuildNode(0, 0, PrimitiveNums);
+    Result.Nodes.resize(NodesNum.load(std::memory_order_relaxed));
+
+    Scratch.clear();
+    Scratch.shrink_to_fit();
+
+    return std::move(Result);
+}
+
+void BVHBuilder::BuildNode(uint32_t NodeIndex, uint32_t Begin, uint32_t End)
+{
+    AABB NodeBounds;
+    AABB CentroidBounds;
+    ComputeBounds(Begin, End, NodeBounds, CentroidBounds);
+
+    Result.Nodes[NodeIndex].Bounds = NodeBounds;
+
+    const uint32_t Count = End - Begin;
+    auto MakeLeaf = [this, NodeIndex, Begin, Count]()
+    {
+        Result.Nodes[NodeIndex].PrimitivesOffset = Begin;
+        Result.Nodes[NodeIndex].PrimitiveCount = Count;
+    };
+
+    if (Count == 1)
+    {
+        MakeLeaf();
+        return;
+    }
+
+    Split Best = FindBestSplit(Begin, End, CentroidBounds, NodeBounds);
+
+    const float LeafCost = Options.IntersectionCost * Count;
+    if (Count <= static_cast<uint32_t>(Options.MaxLeafSize) && (Best.Axis < 0 || LeafCost <= Best.Cost))
+    {
+        MakeLeaf();
+        return;
+    }
+
+    uint32_t Mid;
+    int Axis;
+    if (Best.Axis >= 0)
+    {
+        Axis = Best.Axis;
+        Mid = Partition(Begin, End, Best, CentroidBounds);
+    }
+    else
+    {
+        // All the centroids are at the same place, any split is as good as another
+        Axis = NodeBounds.MaxAxis();
+        Mid = Begin + Count / 2;
+    }
+
+    if (Mid == Begin || Mid == End)
+    {
+        Mid = Begin + Count / 2;
+    }
+
+    uint32_t LeftIndex = AllocateNodePair();
+    uint32_t RightIndex = LeftIndex + 1;
+    Result.Nodes[NodeIndex].Children[0] = LeftIndex;
+    Result.Nodes[NodeIndex].Children[1] = RightIndex;
+    Result.Nodes[NodeIndex].SplitAxis = Axis;
+
+    if (Options.bParallel && Count >= Options.SubtreeTaskSize)
+    {
+        // The other side is built here, the waiting thread then helps with whatever is pending
+        TaskGroup Group;
+        Group.Run([this, LeftIndex, Begin, Mid]() { BuildNode(LeftIndex, Begin, Mid); });
+        BuildNode(RightIndex, Mid, End);
+        Group.Wait();
+    }
+    else
+    {
+        BuildNode(LeftIndex, Begin, Mid);
+        BuildNode(RightIndex, Mid, End);
+    }
+}
+
+void BVHBuilder::ComputeBounds(uint32_t Begin, uint32_t End, AABB& OutNodeBounds, AABB& OutCentroidBounds) const
+{
+    const std::vector<uint32_t>& Indices = Result.PrimitiveIndices;
+
+    auto Accumulate = [this, &Indices](uint32_t First, uint32_t Last, AABB& NodeBounds, AABB& CentroidBounds)
+    {
+        NodeBounds = AABB::Empty();
+        CentroidBounds = AABB::Empty();
+        for (uint32_t i = First; i < Last; ++i)
+        {
+            NodeBounds.Expand(PrimitiveBounds[Indices[i]]);
+            CentroidBounds.Expand(Centroids[Indices[i]]);
+        }
+    };
+
+    if (!IsParallelNode(End - Begin))
+    {
+        Accumulate(Begin, End, OutNodeBounds, OutCentroidBounds);
+        return;
+    }
+
+    const uint32_t ChunkSize = Options.ParallelChunkSize;
+    std::vector<AABB> ChunkBounds(2 * ((End - Begin + ChunkSize - 1) / ChunkSize));
+    uint32_t ChunksNum = ForEachChunk(Begin, End, [&](uint32_t Chunk, uint32_t First, uint32_t Last)
+    {
+        Accumulate(First, Last, ChunkBounds[2 * Chunk], ChunkBounds[2 * Chunk + 1]);
+    });
+
+    OutNodeBounds = AABB::Empty();
+    OutCentroidBounds = AABB::Empty();
+    for (uint32_t c = 0; c < ChunksNum; ++c)
+    {
+        OutNodeBounds.Expand(ChunkBounds[2 * c]);
+        OutCentroidBounds.Expand(ChunkBounds[2 * c + 1]);
+    }
+}
+
+void BVHBuilder::BinPrimitives(uint32_t Begin, uint32_t End, const AABB& CentroidBounds, std::vector<Bin>& OutBins) const
+{
+    const std::vector<uint32_t>& Indices = Result.PrimitiveIndices;
+    const int BinsNum = Options.BinsNum;
+
+    auto Accumulate = [this, &Indices, &CentroidBounds, BinsNum](uint32_t First, uint32_t Last, Bin* Bins)
+    {
+        for (int Axis = 0; Axis < 3; ++Axis)
+        {
+            if (CentroidBounds.Max()[Axis] <= CentroidBounds.Min()[Axis])
+            {
+                continue;
+            }
+
+            Bin* AxisBins = Bins + Axis * BinsNum;
+            for (uint32_t i = First; i < Last; ++i)
+            {
+                Bin& Target = AxisBins[BinIndex(Centroids[Indices[i]], Axis, CentroidBounds)];
+                Target.Bounds.Expand(PrimitiveBounds[Indices[i]]);
+                Target.Count++;
+            }
+        }
+    };
+
+    OutBins.assign(3 * BinsNum, Bin());
+
+    if (!IsParallelNode(End - Begin))
+    {
+        Accumulate(Begin, End, OutBins.data());
+        return;
+    }
+
+    // Every chunk fills its own bins, merged afterwards
+    const uint32_t ChunkSize = Options.ParallelChunkSize;
+    std::vector<Bin> ChunkBins(size_t((End - Begin + ChunkSize - 1) / ChunkSize) * 3 * BinsNum);
+    uint32_t ChunksNum = ForEachChunk(Begin, End, [&](uint32_t Chunk, uint32_t First, uint32_t Last)
+    {
+        Accumulate(First, Last, &ChunkBins[size_t(Chunk) * 3 * BinsNum]);
+    });
+
+    for (uint32_t c = 0; c < ChunksNum; ++c)
+    {
+        for (int b = 0; b < 3 * BinsNum; ++b)
+        {
+            const Bin& Source = ChunkBins[size_t(c) * 3 * BinsNum + b];
+            OutBins[b].Bounds.Expand(Source.Bounds);
+            OutBins[b].Count += Source.Count;
+        }
+    }
+}
+
+BVHBuilder::Split BVHBuilder::FindBestSplit(uint32_t Begin, uint32_t End, const AABB& CentroidBounds, const AABB& NodeBounds) const
+{
+    const int BinsNum = Options.BinsNum;
+    const float NodeArea = std::max(NodeBounds.SurfaceArea(), 1e-20f);
+
+    Split Best;
+    std::vector<Bin> AllBins;
+    std::vector<float> RightAreas(BinsNum);
+    std::vector<uint32_t> RightCounts(BinsNum);
+
+    BinPrimitives(Begin, End, CentroidBounds, AllBins);
+
+    for (int Axis = 0; Axis < 3; ++Axis)
+    {
+        if (CentroidBounds.Max()[Axis] <= CentroidBounds.Min()[Axis])
+        {
+            continue;
+        }
+
+        const Bin* Bins = &AllBins[Axis * BinsNum];
+
+        // Sweep from the right to get the area and count right of every plane
+        AABB RightBounds = AABB::Empty();
+        uint32_t RightCount = 0;
+        for (int b = BinsNum - 1; b > 0; --b)
+        {
+            RightBounds.Expand(Bins[b].Bounds);
+            RightCount += Bins[b].Count;
+            RightAreas[b - 1] = RightBounds.SurfaceArea();
+            RightCounts[b - 1] = RightCount;
+        }
+
+        // Then from the left, splitting after bin b
+        AABB LeftBounds = AABB::Empty();
+        uint32_t LeftCount = 0;
+        for (int b = 0; b < BinsNum - 1; ++b)
+        {
+            LeftBounds.Expand(Bins[b].Bounds);
+            LeftCount += Bins[b].Count;
+
+            if (LeftCount == 0 || RightCounts[b] == 0)
+            {
+                continue;
+            }
+
+            float Cost = Options.TraversalCost
+                       + Options.IntersectionCost * (LeftBounds.SurfaceArea() * LeftCount + RightAreas[b] * RightCounts[b]) / NodeArea;
+            if (Cost < Best.Cost)
+            {
+                Best.Axis = Axis;
+                Best.BinIndex = b;
+                Best.Cost = Cost;
+            }
+        }
+    }
+
+    return Best;
+}
+
+uint32_t BVHBuilder::Partition(uint32_t Begin, uint32_t End, const Split& InSplit, const AABB& CentroidBounds)
+{
+    std::vector<uint32_t>& Indices = Result.PrimitiveIndices;
+
+    if (!IsParallelNode(End - Begin))
+    {
+        auto Middle = std::partition(Indices.begin() + Begin, Indices.begin() + End,
+            [this, &InSplit, &CentroidBounds](uint32_t Index)
+            {
+                return IsLeftOf(Index, InSplit, CentroidBounds);
+            });
+        return static_cast<uint32_t>(Middle - Indices.begin());
+    }
+
+    // Count the left primitives of every chunk, then every chunk scatters its
+    // primitives at its own offsets on both sides and the result is copied back
+    const uint32_t ChunkSize = Options.ParallelChunkSize;
+    std::vector<uint32_t> LeftCounts((End - Begin + ChunkSize - 1) / ChunkSize);
+    uint32_t ChunksNum = ForEachChunk(Begin, End, [&](uint32_t Chunk, uint32_t First, uint32_t Last)
+    {
+        uint32_t LeftCount = 0;
+        for (uint32_t i = First; i < Last; ++i)
+        {
+            LeftCount += IsLeftOf(Indices[i], InSplit, CentroidBounds) ? 1 : 0;
+        }
+        LeftCounts[Chunk] = LeftCount;
+    });
+
+    std::vector<uint32_t> LeftOffsets(ChunksNum);
+    std::vector<uint32_t> RightOffsets(ChunksNum);
+    uint32_t LeftTotal = 0;
+    for (uint32_t c = 0; c < ChunksNum; ++c)
+    {
+        LeftOffsets[c] = Begin + LeftTotal;
+        LeftTotal += LeftCounts[c];
+    }
+    uint32_t RightTotal = 0;
+    for (uint32_t c = 0; c < ChunksNum; ++c)
+    {
+        RightOffsets[c] = Begin + LeftTotal + RightTotal;
+        RightTotal += std::min(End, Begin + (c + 1) * ChunkSize) - (Begin + c * ChunkSize) - LeftCounts[c];
+    }
+
+    ForEachChunk(Begin, End, [&](uint32_t Chunk, uint32_t First, uint32_t Last)
+    {
+        uint32_t Left = LeftOffsets[Chunk];
+        uint32_t Right = RightOffsets[Chunk];
+        for (uint32_t i = First; i < Last; ++i)
+        {
+            uint32_t Index = Indices[i];
+            Scratch[IsLeftOf(Index, InSplit, CentroidBounds) ? Left++ : Right++] = Index;
+        }
+    });
+
+    ForEachChunk(Begin, End, [&](uint32_t, uint32_t First, uint32_t Last)
+    {
+        std::copy(Scratch.begin() + First, Scratch.begin() + Last, Indices.begin() + First);
+    });
+
+    return Begin + LeftTotal;
+}
+
+float BVHBuilder::ComputeSAHCost(const BVHBuildResult& Result, const BVHBuildOptions& Options)
+{
+    if (Result.IsEmpty())
+    {
+        return 0.0f;
+    }
+
+    const float RootArea = std::max(Result.Nodes[0].Bounds.SurfaceArea(), 1e-20f);
+    float Cost = 0.0f;
+    for (const BVHBuildNode& Node : Result.Nodes)
+    {
+        float Probability = Node.Bounds.SurfaceArea() / RootArea;
+        Cost += Probability * (Node.IsLeaf() ? Options.IntersectionCost * Node.PrimitiveCount : Options.TraversalCost);
+    }
+    return Cost;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "AABB.h"
+#include "BVHBuilder.h"
+#include "BVHStats.h"
+#include "LBVHBuilder.h"
+#include "SBVHBuilder.h"
+
+#include <iostream>
+#include <vector>
+
+/// Build a BVH over the bounds with the method picked in the options.
+/// Every accelerator builds through here, so they all report their trees when asked.
+inline BVHBuildResult BuildBVH(const std::vector<AABB>& PrimitiveBounds, const BVHBuildOptions& Options)
+{
+    BVHBuildResult Result;
+    switch (Options.Method)
+    {
+        case BVHBuildMethod::LBVH:
+        case BVHBuildMethod::HLBVH:
+            Result = LBVHBuilder(PrimitiveBounds, Options).Build();
+            break;
+        case BVHBuildMethod::SBVH:
+            Result = SBVHBuilder(PrimitiveBounds, Options).Build();
+            break;
+        case BVHBuildMethod::BinnedSAH:
+        default:
+            Result = BVHBuilder(PrimitiveBounds, Options).Build();
+            break;
+    }
+
+    if (Options.bReportStats)
+    {
+        BVHBuildStats::Compute(Result, Options).Print(std::cerr);
+    }
+    return Result;
+}
@@ -0,0 +1,268 @@
+#pragma once
+
+#include "RTWeekend.h"
+
+#include "AABB.h"
+#include "BVHBuilder.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+    #define RT_BVH_CACHE_MMAP 1
+#elif defined(_WIN32)
+    #include <process.h>
+#endif
+
+/// First 64 bytes of a cache file. The nodes follow at NodesOffset exactly as they
+/// are in memory, then the build index of every primitive in leaf order.
+struct BVHCacheHeader
+{
+    char Magic[8];
+    uint32_t Version;
+    uint32_t NodeSize;      // sizeof the node struct, a layout change invalidates the file
+    uint64_t SceneHash;
+    uint64_t NodesNum;
+    uint64_t PrimitivesNum;
+    uint64_t NodesOffset;
+    uint64_t IndicesOffset;
+    int32_t Depth;
+    uint32_t Pad;
+};
+
+static_assert(sizeof(BVHCacheHeader) == 64, "BVHCacheHeader must stay 64 bytes");
+
+static const char BVHCacheMagic[8] = { 'R', 'T', 'B', 'V', 'H', 'C', 0, 0 };
+
+// Bump when the format or the builders change the trees they output
+static const uint32_t BVHCacheVersion = 2;
+
+/// Hash of everything a build depends on: the primitive bounds, in order, and
+/// the options shaping the tree. Two scenes with the same hash get the same tree.
+inline uint64_t HashBVHInput(const std::vector<AABB>& Bounds, const BVHBuildOptions& Options)
+{
+    // FNV-1a over 32 bits words
+    uint64_t Hash = 14695981039346656037ull;
+    auto Mix = [&Hash](const void* Data, size_t Bytes)
+    {
+        const unsigned char* Input = static_cast<const unsigned char*>(Data);
+        for (size_t i = 0; i + 4 <= Bytes; i += 4)
+        {
+            uint32_t Word;
+            std::memcpy(&Word, Input + i, sizeof(Word));
+            Hash = (Hash ^ Word) * 1099511628211ull;
+        }
+    };
+
+    const uint64_t PrimitivesNum = Bounds.size();
+    Mix(&PrimitivesNum, sizeof(PrimitivesNum));
+    for (const AABB& Box : Bounds)
+    {
+        const float Planes[6] = { Box.Minimum[0], Box.Minimum[1], Box.Minimum[2], Box.Maximum[0], Box.Maximum[1], Box.Maximum[2] };
+        Mix(Planes, sizeof(Planes));
+    }
+
+    const int32_t Integers[6] = {
+        static_cast<int32_t>(Options.Method), Options.MaxLeafSize, Options.BinsNum, Options.MortonBits,
+        static_cast<int32_t>(Options.Layout), Options.TreeletBytes };
+    const float Floats[4] = { Options.TraversalCost, Options.IntersectionCost, Options.SpatialSplitAlpha, Options.MaxDuplication };
+    Mix(Integers, sizeof(Integers));
+    Mix(Floats, sizeof(Floats));
+    return Hash;
+}
+
+inline std::string BVHCachePath(const std::string& Directory, uint64_t SceneHash)
+{
+    char Name[32];
+    std::snprintf(Name, sizeof(Name), "%016llx.bvh", static_cast<unsigned long long>(SceneHash));
+    return Directory + "/" + Name;
+}
+
+/// Temporary file next to Path, unique to the process, thread and write, so
+/// renders caching the same scene at once never write into the same file.
+inline std::string BVHCacheTempPath(const std::string& Path)
+{
+    static std::atomic<uint32_t> WritesNum(0);
+
+#if defined(RT_BVH_CACHE_MMAP)
+    const unsigned long long ProcessId = static_cast<unsigned long long>(getpid());
+#elif defined(_WIN32)
+    const unsigned long long ProcessId = static_cast<unsigned long long>(_getpid());
+#else
+    const unsigned long long ProcessId = 0;
+#endif
+    const unsigned long long ThreadId = std::hash<std::thread::id>()(std::this_thread::get_id());
+
+    char Suffix[64];
+    std::snprintf(Suffix, sizeof(Suffix), ".%llu.%llx.%u.tmp", ProcessId, ThreadId, WritesNum.fetch_add(1));
+    return Path + Suffix;
+}
+
+/// Built tree read back from a cache file. The file is memory mapped where the
+/// platform allows it, so the nodes are used in place without being copied or
+/// even read before traversal touches them.
+class BVHCacheFile
+{
+    public:
+        /// Null when the file is missing or was written for another scene, version or node layout.
+        static shared_ptr<BVHCacheFile> Open(const std::string& Path, uint64_t SceneHash, uint32_t NodeSize);
+
+        /// Write through a temporary file of its own renamed at the end, so concurrent
+        /// renders never see a partial file, the last rename wins.
+        static bool Write(
+            const std::string& Path, uint64_t SceneHash, const void* Nodes, uint64_t NodesNum, uint32_t NodeSize,
+            const std::vector<uint32_t>& PrimitiveIndices, int32_t Depth);
+
+        ~BVHCacheFile();
+
+        BVHCacheFile(const BVHCacheFile&) = delete;
+        BVHCacheFile& operator=(const BVHCacheFile&) = delete;
+
+        inline const BVHCacheHeader& GetHeader() const { return *reinterpret_cast<const BVHCacheHeader*>(Data); }
+        inline const void* GetNodes() const { return Data + GetHeader().NodesOffset; }
+        inline const uint32_t* GetPrimitiveIndices() const { return reinterpret_cast<const uint32_t*>(Data + GetHeader().IndicesOffset); }
+
+    private:
+        BVHCacheFile() {}
+
+        bool IsValid(uint64_t SceneHash, uint32_t NodeSize) const;
+
+    private:
+        // Copy of the file where it cannot be mapped, aligned like the mapping would be
+        struct alignas(64) CacheBlock
+        {
+            unsigned char Bytes[64];
+        };
+
+        const unsigned char* Data = nullptr;
+        size_t Size = 0;
+        bool bMapped = false;
+        std::vector<CacheBlock> Buffer;
+};
+
+shared_ptr<BVHCacheFile> BVHCacheFile::Open(const std::string& Path, uint64_t SceneHash, uint32_t NodeSize)
+{
+    shared_ptr<BVHCacheFile> File(new BVHCacheFile());
+
+#if defined(RT_BVH_CACHE_MMAP)
+    int Descriptor = open(Path.c_str(), O_RDONLY);
+    if (Descriptor < 0)
+    {
+        return nullptr;
+    }
+
+    struct stat Status;
+    if (fstat(Descriptor, &Status) != 0 || Status.st_size < static_cast<off_t>(sizeof(BVHCacheHeader)))
+    {
+        close(Descriptor);
+        return nullptr;
+    }
+
+    void* Mapping = mmap(nullptr, static_cast<size_t>(Status.st_size), PROT_READ, MAP_PRIVATE, Descriptor, 0);
+    close(Descriptor);
+    if (Mapping == MAP_FAILED)
+    {
+        return nullptr;
+    }
+
+    File->Data = static_cast<const unsigned char*>(Mapping);
+    File->Size = static_cast<size_t>(Status.st_size);
+    File->bMapped = true;
+#else
+    std::ifstream In(Path, std::ios::binary | std::ios::ate);
+    if (!In)
+    {
+        return nullptr;
+    }
+
+    File->Size = static_cast<size_t>(In.tellg());
+    File->Buffer.resize((File->Size + sizeof(CacheBlock) - 1) / sizeof(CacheBlock));
+    In.seekg(0);
+    if (File->Size < sizeof(BVHCacheHeader) || !In.read(reinterpret_cast<char*>(File->Buffer.data()), File->Size))
+    {
+        return nullptr;
+    }
+    File->Data = File->Buffer.front().Bytes;
+#endif
+
+    return File->IsValid(SceneHash, NodeSize) ? File : nullptr;
+}
+
+bool BVHCacheFile::IsValid(uint64_t SceneHash, uint32_t NodeSize) const
+{
+    const BVHCacheHeader& Header = GetHeader();
+    if (std::memcmp(Header.Magic, BVHCacheMagic, sizeof(BVHCacheMagic)) != 0
+        || Header.Version != BVHCacheVersion || Header.NodeSize != NodeSize || Header.SceneHash != SceneHash)
+    {
+        return false;
+    }
+
+    // Truncated or otherwise damaged files. The depth sizes the traversal stack
+    if (Header.Depth <= 0 || static_cast<uint64_t>(Header.Depth) > Header.NodesNum)
+    {
+        return false;
+    }
+    return Header.NodesOffset % 64 == 0 && Header.NodesOffset >= sizeof(BVHCacheHeader)
+        && Header.NodesOffset + Header.NodesNum * NodeSize <= Header.IndicesOffset
+        && Header.IndicesOffset + Header.PrimitivesNum * sizeof(uint32_t) <= Size;
+}
+
+BVHCacheFile::~BVHCacheFile()
+{
+#if defined(RT_BVH_CACHE_MMAP)
+    if (bMapped)
+    {
+        munmap(const_cast<unsigned char*>(Data), Size);
+    }
+#endif
+}
+
+bool BVHCacheFile::Write(
+    const std::string& Path, uint64_t SceneHash, const void* Nodes, uint64_t NodesNum, uint32_t NodeSize,
+    const std::vector<uint32_t>& PrimitiveIndices, int32_t Depth)
+{
+    BVHCacheHeader Header;
+    std::memcpy(Header.Magic, BVHCacheMagic, sizeof(BVHCacheMagic));
+    Header.Version = BVHCacheVersion;
+    Header.NodeSize = NodeSize;
+    Header.SceneHash = SceneHash;
+    Header.NodesNum = NodesNum;
+    Header.PrimitivesNum = PrimitiveIndices.size();
+    Header.NodesOffset = sizeof(BVHCacheHeader);
+    Header.IndicesOffset = Header.NodesOffset + NodesNum * NodeSize;
+    Header.Depth = Depth;
+    Header.Pad = 0;
+
+    const std::string TempPath = BVHCacheTempPath(Path);
+    {
+        std::ofstream Out(TempPath, std::ios::binary | std::ios::trunc);
+        Out.write(reinterpret_cast<const char*>(&Header), sizeof(Header));
+        Out.write(static_cast<const char*>(Nodes), static_cast<std::streamsize>(NodesNum * NodeSize));
+        Out.write(reinterpret_cast<const char*>(PrimitiveIndices.data()), static_cast<std::streamsize>(PrimitiveIndices.size() * sizeof(uint32_t)));
+        if (!Out)
+        {
+            std::cerr << "Could not write the BVH cache " << TempPath << '\n';
+            std::remove(TempPath.c_str());
+            return false;
+        }
+    }
+
+    if (std::rename(TempPath.c_str(), Path.c_str()) != 0)
+    {
+        std::cerr << "Could not write the BVH cache " << Path << '\n';
+        std::remove(TempPath.c_str());
+        return false;
+    }
+    return true;
+}
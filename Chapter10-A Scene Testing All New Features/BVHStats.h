@@ -0,0 +1,271 @@
+#pragma once
+
+#include "RTWeekend.h"
+
+#include "AABB.h"
+#include "BVHBuilder.h"
+
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/// Quality of a built tree, to tell a bad tree from expensive primitives. Taken
+/// on the binary tree of the builders, before the wide BVHs collapse it.
+struct BVHBuildStats
+{
+    uint64_t PrimitiveRefsNum = 0;
+    uint64_t NodesNum = 0;
+    uint64_t LeavesNum = 0;
+    float SAHCost = 0.0f;
+
+    int MaxDepth = 0;
+    double AverageLeafDepth = 0.0;
+    // Leaves at every depth, the root being at depth 1
+    std::vector<uint64_t> LeafDepths;
+    // Leaves of every primitive count
+    std::vector<uint64_t> LeafSizes;
+
+    // Area shared by the two children of the interior nodes over the area of the
+    // nodes, 0 for disjoint children
+    double OverlapRatio = 0.0;
+
+    static BVHBuildStats Compute(const BVHBuildResult& Result, const BVHBuildOptions& Options);
+
+    void Print(std::ostream& Out) const;
+};
+
+BVHBuildStats BVHBuildStats::Compute(const BVHBuildResult& Result, const BVHBuildOptions& Options)
+{
+    BVHBuildStats Stats;
+    if (Result.IsEmpty())
+    {
+        return Stats;
+    }
+
+    Stats.PrimitiveRefsNum = Result.PrimitiveIndices.size();
+    Stats.SAHCost = BVHBuilder::ComputeSAHCost(Result, Options);
+
+    double OverlapArea = 0.0;
+    double InteriorArea = 0.0;
+    double LeafDepthSum = 0.0;
+
+    std::vector<std::pair<uint32_t, int>> Stack;
+    Stack.push_back({ 0, 1 });
+    while (!Stack.empty())
+    {
+        const uint32_t Index = Stack.back().first;
+        const int Depth = Stack.back().second;
+        Stack.pop_back();
+
+        const BVHBuildNode& Node = Result.Nodes[Index];
+        Stats.NodesNum++;
+        Stats.MaxDepth = std::max(Stats.MaxDepth, Depth);
+
+        if (Node.IsLeaf())
+        {
+            Stats.LeavesNum++;
+            LeafDepthSum += Depth;
+            if (Stats.LeafDepths.size() <= static_cast<size_t>(Depth))
+            {
+                Stats.LeafDepths.resize(Depth + 1, 0);
+            }
+            Stats.LeafDepths[Depth]++;
+            if (Stats.LeafSizes.size() <= Node.PrimitiveCount)
+            {
+                Stats.LeafSizes.resize(Node.PrimitiveCount + 1, 0);
+            }
+            Stats.LeafSizes[Node.PrimitiveCount]++;
+            continue;
+        }
+
+        const AABB& Left = Result.Nodes[Node.Children[0]].Bounds;
+        const AABB& Right = Result.Nodes[Node.Children[1]].Bounds;
+        AABB Overlap;
+        for (int a = 0; a < 3; ++a)
+        {
+            Overlap.Minimum[a] = std::max(Left.Minimum[a], Right.Minimum[a]);
+            Overlap.Maximum[a] = std::min(Left.Maximum[a], Right.Maximum[a]);
+        }
+        OverlapArea += Overlap.SurfaceArea();
+        InteriorArea += Node.Bounds.SurfaceArea();
+
+        Stack.push_back({ Node.Children[0], Depth + 1 });
+        Stack.push_back({ Node.Children[1], Depth + 1 });
+    }
+
+    Stats.AverageLeafDepth = LeafDepthSum / std::max<uint64_t>(Stats.LeavesNum, 1);
+    Stats.OverlapRatio = InteriorArea > 0.0 ? OverlapArea / InteriorArea : 0.0;
+    return Stats;
+}
+
+void BVHBuildStats::Print(std::ostream& Out) const
+{
+    const std::ios::fmtflags Flags = Out.flags();
+    const std::streamsize Precision = Out.precision();
+
+    Out << std::fixed << std::setprecision(2)
+        << "BVH build: " << PrimitiveRefsNum << " primitive references, " << NodesNum << " nodes, "
+        << LeavesNum << " leaves, SAH cost " << SAHCost << '\n'
+        << "  Depth: max " << MaxDepth << ", average leaf " << AverageLeafDepth << '\n'
+        << "  Children overlap: " << OverlapRatio * 100.0 << "% of the parent area\n";
+
+    Out << "  Leaves per depth:";
+    for (size_t Depth = 1; Depth < LeafDepths.size(); ++Depth)
+    {
+        if (LeafDepths[Depth] > 0)
+        {
+            Out << ' ' << Depth << ':' << LeafDepths[Depth];
+        }
+    }
+    Out << "\n  Leaves per size:";
+    for (size_t Size = 1; Size < LeafSizes.size(); ++Size)
+    {
+        if (LeafSizes[Size] > 0)
+        {
+            Out << ' ' << Size << ':' << LeafSizes[Size];
+        }
+    }
+    Out << '\n';
+
+    Out.flags(Flags);
+    Out.precision(Precision);
+}
+
+/// Work done per ray by the accelerators, split between primary rays and the
+/// bounces. Every thread counts on its own, the totals are summed at the end.
+struct BVHRayCounters
+{
+    uint64_t Rays = 0;
+    uint64_t NodesVisited = 0;
+    uint64_t BoxesTested = 0;
+    uint64_t PrimitivesTested = 0;
+
+    inline void Add(const BVHRayCounters& Other)
+    {
+        Rays += Other.Rays;
+        NodesVisited += Other.NodesVisited;
+        BoxesTested += Other.BoxesTested;
+        PrimitivesTested += Other.PrimitivesTested;
+    }
+};
+
+/// Only counted when compiled with RT_BVH_STATS, through the RT_BVH_STAT macro,
+/// so the traversal loops pay nothing otherwise.
+class BVHTraversalStats
+{
+    public:
+        enum RayKind
+        {
+            Primary,
+            Secondary,
+            RayKindsNum
+        };
+
+        /// The following counts go to this ray, until the next one begins.
+        static inline void BeginRay(bool bPrimary)
+        {
+            ThreadCounters& Counters = Local();
+            Counters.Kind = bPrimary ? Primary : Secondary;
+            Counters.Kinds[Counters.Kind].Rays++;
+        }
+
+        static inline void CountNodes(uint64_t Count) { Local().Current().NodesVisited += Count; }
+        static inline void CountBoxes(uint64_t Count) { Local().Current().BoxesTested += Count; }
+        static inline void CountPrimitives(uint64_t Count) { Local().Current().PrimitivesTested += Count; }
+
+        /// Sum over the threads. Only exact while no thread is tracing.
+        static BVHRayCounters GetTotal(RayKind Kind);
+
+        static void Reset();
+
+        /// Averages per ray of both kinds.
+        static void Print(std::ostream& Out);
+
+    private:
+        struct ThreadCounters
+        {
+            int Kind = Primary;
+            BVHRayCounters Kinds[RayKindsNum];
+
+            inline BVHRayCounters& Current() { return Kinds[Kind]; }
+        };
+
+        static inline ThreadCounters& Local()
+        {
+            thread_local ThreadCounters* Counters = Register();
+            return *Counters;
+        }
+
+        static ThreadCounters* Register()
+        {
+            std::lock_guard<std::mutex> Lock(RegistryMutex());
+            Registry().push_back(std::unique_ptr<ThreadCounters>(new ThreadCounters()));
+            return Registry().back().get();
+        }
+
+        static std::mutex& RegistryMutex()
+        {
+            static std::mutex Mutex;
+            return Mutex;
+        }
+
+        // Never shrinks, the counters outlive their threads
+        static std::vector<std::unique_ptr<ThreadCounters>>& Registry()
+        {
+            static std::vector<std::unique_ptr<ThreadCounters>> Counters;
+            return Counters;
+        }
+};
+
+BVHRayCounters BVHTraversalStats::GetTotal(RayKind Kind)
+{
+    std::lock_guard<std::mutex> Lock(RegistryMutex());
+    BVHRayCounters Total;
+    for (const std::unique_ptr<ThreadCounters>& Counters : Registry())
+    {
+        Total.Add(Counters->Kinds[Kind]);
+    }
+    return Total;
+}
+
+void BVHTraversalStats::Reset()
+{
+    std::lock_guard<std::mutex> Lock(RegistryMutex());
+    for (const std::unique_ptr<ThreadCounters>& Counters : Registry())
+    {
+        for (BVHRayCounters& Kind : Counters->Kinds)
+        {
+            Kind = BVHRayCounters();
+        }
+    }
+}
+
+void BVHTraversalStats::Print(std::ostream& Out)
+{
+    const std::ios::fmtflags Flags = Out.flags();
+    const std::streamsize Precision = Out.precision();
+
+    const char* Names[RayKindsNum] = { "Primary", "Secondary" };
+    Out << "BVH traversal per ray:\n" << std::fixed << std::setprecision(2);
+    for (int Kind = 0; Kind < RayKindsNum; ++Kind)
+    {
+        const BVHRayCounters Total = GetTotal(static_cast<RayKind>(Kind));
+        const double Rays = static_cast<double>(std::max<uint64_t>(Total.Rays, 1));
+        Out << "  " << std::left << std::setw(10) << Names[Kind] << std::right << Total.Rays << " rays, "
+            << Total.NodesVisited / Rays << " nodes visited, "
+            << Total.BoxesTested / Rays << " boxes tested, "
+            << Total.PrimitivesTested / Rays << " primitives tested\n";
+    }
+
+    Out.flags(Flags);
+    Out.precision(Precision);
+}
+
+#if defined(RT_BVH_STATS)
+    #define RT_BVH_STAT(Call) BVHTraversalStats::Call
+#else
+    #define RT_BVH_STAT(Call) ((void)0)
+#endif
@@ -48,6 +48,9 @@ class Camera
                 );
         }
 
+        inline float GetShutterOpen() const { return Time0; }
+        inline float GetShutterClose() const { return Time1; }
+
     private:
         Point3 Origin;
         Point3 LowerLeftCorner;
@@ -0,0 +1,376 @@
+#pragma once
+
+#include "RTWeekend.h"
+
+#include "BVHBuilders.h"
+#include "Hittable.h"
+#include "HittableList.h"
+#include "WideBVH.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/// 4 children in 64 bytes, half of a WideBVHNode<4>. The children boxes are stored
+/// on 8 bits per plane in the grid of the node: plane q of axis a is at
+/// Origin[a] + q * 2^Exponents[a]. Mins are rounded down and maxs up, so the
+/// decoded boxes always contain the actual ones.
+///
+/// Like WideBVHNode, a child is a node when Counts[i] == 0, a leaf of Counts[i]
+/// primitives starting at Children[i] otherwise. Unused slots are cleared in ChildMask.
+struct alignas(64) CompressedBVHNode
+{
+    float Origin[3];
+    int8_t Exponents[3];
+    uint8_t ChildMask;
+    uint8_t QuantizedMin[3][4];
+    uint8_t QuantizedMax[3][4];
+    int32_t Children[4];
+    uint16_t Counts[4];
+};
+
+static_assert(sizeof(CompressedBVHNode) == 64, "CompressedBVHNode must stay 64 bytes");
+
+/// 4 wide BVH with quantized children boxes, for scenes where the tree no longer
+/// fits in the caches. Traversal decodes the boxes of a node before testing them,
+/// a few more instructions for half the memory traffic of the QBVH. The quantized
+/// boxes are a little bigger than the actual ones, so rays visit slightly more nodes.
+class CompressedBVH : public Hittable
+{
+    public:
+        static const int StackSize = 64 * 3 + 1;
+
+        CompressedBVH(const HittableList& List, float Time0, float Time1, const BVHBuildOptions& Options = BVHBuildOptions())
+            : CompressedBVH(List.Objects, 0, List.Objects.size(), Time0, Time1, Options)
+        {}
+
+        CompressedBVH(
+            const std::vector<shared_ptr<Hittable>>& SrcObjects,
+            size_t Start, size_t End, float Time0, float Time1,
+            const BVHBuildOptions& Options = BVHBuildOptions());
+
+        virtual bool Hit(const Ray& InRay, float tMin, float tMax, HitRecord& Record) const override;
+
+        virtual bool BoundingBox(float InTime0, float InTime1, AABB& OutputBox) const override;
+
+        inline const std::vector<CompressedBVHNode>& GetNodes() const { return Nodes; }
+
+        /// Nodes and primitive references, not the primitives themselves.
+        inline size_t GetMemoryBytes() const
+        {
+            return Nodes.size() * sizeof(CompressedBVHNode) + Primitives.size() * sizeof(shared_ptr<Hittable>);
+        }
+
+    private:
+        struct StackEntry
+        {
+            int32_t Child;
+            uint16_t Count;
+            float tEntry;
+        };
+
+        int32_t Collapse(const BVHBuildResult& Build, uint32_t BuildIndex, int NodeDepth);
+
+        /// 2^Exponent, built from the bits as the exponent is always in the normal range.
+        static inline float ExponentScale(int8_t Exponent)
+        {
+            uint32_t Bits = static_cast<uint32_t>(Exponent + 127) << 23;
+            float Scale;
+            std::memcpy(&Scale, &Bits, sizeof(Scale));
+            return Scale;
+        }
+
+        /// Smallest exponent whose 255 steps from Origin reach Max.
+        static int8_t FindExponent(float Origin, float Max);
+
+        static int IntersectChildren(
+            const CompressedBVHNode& Node, const float Origin[3], const float InvDir[3],
+            const int NearSide[3], float tMin, float tMax, float OutEntries[4]);
+
+    private:
+        std::vector<CompressedBVHNode> Nodes;
+        std::vector<shared_ptr<Hittable>> Primitives;
+        AABB Box;
+        int Depth = 0;
+};
+
+CompressedBVH::CompressedBVH(
+    const std::vector<shared_ptr<Hittable>>& SrcObjects,
+    size_t Start, size_t End, float Time0, float Time1,
+    const BVHBuildOptions& Options)
+{
+    std::vector<AABB> PrimitiveBounds;
+    CollectPrimitiveBounds(SrcObjects, Start, End, Time0, Time1, PrimitiveBounds, Options.bParallel);
+
+    BVHBuildOptions CompressedOptions = Options;
+    CompressedOptions.MaxLeafSize = std::min(CompressedOptions.MaxLeafSize, 0xFFFF);
+    BVHBuildResult Build = BuildBVH(PrimitiveBounds, CompressedOptions);
+
+    if (Build.IsEmpty())
+    {
+        std::cerr << "No object in CompressedBVH constructor.\n";
+        return;
+    }
+
+    Primitives.reserve(Build.PrimitiveIndices.size());
+    for (uint32_t Index : Build.PrimitiveIndices)
+    {
+        Primitives.push_back(SrcObjects[Start + Index]);
+    }
+
+    Nodes.reserve(Build.Nodes.size() / 3 + 1);
+    Collapse(Build, 0, 1);
+    Box = Build.Nodes[0].Bounds;
+}
+
+int8_t CompressedBVH::FindExponent(float Origin, float Max)
+{
+    const float Extent = Max - Origin;
+    int Exponent = -126;
+    if (Extent > 0.0f)
+    {
+        Exponent = std::max(static_cast<int>(std::ceil(std::log2(Extent / 255.0f))), -126);
+    }
+
+    // Rounding in the decode may still fall short of Max
+    while (Exponent < 127 && Origin + 255.0f * ExponentScale(static_cast<int8_t>(Exponent)) < Max)
+    {
+        ++Exponent;
+    }
+    return static_cast<int8_t>(std::min(Exponent, 127));
+}
+
+int32_t CompressedBVH::Collapse(const BVHBuildResult& Build, uint32_t BuildIndex, int NodeDepth)
+{
+    Depth = std::max(Depth, NodeDepth);
+
+    std::vector<uint32_t> Slots;
+    CollapseChildren(Build, BuildIndex, 4, Slots);
+
+    AABB NodeBounds = AABB::Empty();
+    for (uint32_t Slot : Slots)
+    {
+        NodeBounds.Expand(Build.Nodes[Slot].Bounds);
+    }
+
+    const int32_t NodeIndex = static_cast<int32_t>(Nodes.size());
+    Nodes.emplace_back();
+
+    float Scales[3];
+    {
+        CompressedBVHNode& Node = Nodes[NodeIndex];
+        Node.ChildMask = 0;
+        for (int a = 0; a < 3; ++a)
+        {
+            Node.Origin[a] = NodeBounds.Min()[a];
+            Node.Exponents[a] = FindExponent(Node.Origin[a], NodeBounds.Max()[a]);
+            Scales[a] = ExponentScale(Node.Exponents[a]);
+        }
+    }
+
+    for (int i = 0; i < 4; ++i)
+    {
+        CompressedBVHNode& Node = Nodes[NodeIndex];
+        if (i >= static_cast<int>(Slots.size()))
+        {
+            for (int a = 0; a < 3; ++a)
+            {
+                Node.QuantizedMin[a][i] = 255;
+                Node.QuantizedMax[a][i] = 0;
+            }
+            Node.Children[i] = -1;
+            Node.Counts[i] = 0;
+            continue;
+        }
+
+        const BVHBuildNode& Child = Build.Nodes[Slots[i]];
+        for (int a = 0; a < 3; ++a)
+        {
+            // Step by step towards the conservative side when the float rounding
+            // of the division landed on the wrong one
+            const float Min = Child.Bounds.Min()[a];
+            const float Max = Child.Bounds.Max()[a];
+            int QMin = static_cast<int>(std::floor((Min - Node.Origin[a]) / Scales[a]));
+            int QMax = static_cast<int>(std::ceil((Max - Node.Origin[a]) / Scales[a]));
+            QMin = std::min(std::max(QMin, 0), 255);
+            QMax = std::min(std::max(QMax, 0), 255);
+            while (QMin > 0 && Node.Origin[a] + QMin * Scales[a] > Min)
+            {
+                --QMin;
+            }
+            while (QMax < 255 && Node.Origin[a] + QMax * Scales[a] < Max)
+            {
+                ++QMax;
+            }
+            Node.QuantizedMin[a][i] = static_cast<uint8_t>(QMin);
+            Node.QuantizedMax[a][i] = static_cast<uint8_t>(QMax);
+        }
+        Node.ChildMask |= 1 << i;
+
+        if (Child.IsLeaf())
+        {
+            Node.Children[i] = static_cast<int32_t>(Child.PrimitivesOffset);
+            Node.Counts[i] = static_cast<uint16_t>(Child.PrimitiveCount);
+        }
+        else
+        {
+            // Nodes may reallocate, index it again after the recursion
+            int32_t ChildIndex = Collapse(Build, Slots[i], NodeDepth + 1);
+            Nodes[NodeIndex].Children[i] = ChildIndex;
+            Nodes[NodeIndex].Counts[i] = 0;
+        }
+    }
+
+    return NodeIndex;
+}
+
+int CompressedBVH::IntersectChildren(
+    const CompressedBVHNode& Node, const float Origin[3], const float InvDir[3],
+    const int NearSide[3], float tMin, float tMax, float OutEntries[4])
+{
+    const uint8_t* Planes[2][3] = {
+        { Node.QuantizedMin[0], Node.QuantizedMin[1], Node.QuantizedMin[2] },
+        { Node.QuantizedMax[0], Node.QuantizedMax[1], Node.QuantizedMax[2] }
+    };
+
+#if defined(RT_WIDE_BVH_SSE) && (defined(__SSE2__) || defined(_M_X64))
+    const __m128i Zero = _mm_setzero_si128();
+    __m128 Entry = _mm_set1_ps(tMin);
+    __m128 Exit = _mm_set1_ps(tMax);
+    for (int a = 0; a < 3; ++a)
+    {
+        // Decode the 4 planes on each side: widen the bytes to floats, then into the node grid
+        const __m128 O = _mm_set1_ps(Origin[a]);
+        const __m128 I = _mm_set1_ps(InvDir[a]);
+        const __m128 NodeOrigin = _mm_set1_ps(Node.Origin[a]);
+        const __m128 Scale = _mm_set1_ps(ExponentScale(Node.Exponents[a]));
+
+        int32_t NearBytes;
+        int32_t FarBytes;
+        std::memcpy(&NearBytes, Planes[NearSide[a]][a], sizeof(NearBytes));
+        std::memcpy(&FarBytes, Planes[1 - NearSide[a]][a], sizeof(FarBytes));
+        const __m128 NearQ = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(NearBytes), Zero), Zero));
+        const __m128 FarQ = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(FarBytes), Zero), Zero));
+
+        const __m128 Near = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(NodeOrigin, _mm_mul_ps(NearQ, Scale)), O), I);
+        const __m128 Far = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(NodeOrigin, _mm_mul_ps(FarQ, Scale)), O), I);
+        Entry = _mm_max_ps(Near, Entry);
+        Exit = _mm_min_ps(Far, Exit);
+    }
+    _mm_storeu_ps(OutEntries, Entry);
+    return _mm_movemask_ps(_mm_cmplt_ps(Entry, Exit)) & Node.ChildMask;
+#else
+    float Scales[3];
+    for (int a = 0; a < 3; ++a)
+    {
+        Scales[a] = ExponentScale(Node.Exponents[a]);
+    }
+
+    int Mask = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        float Entry = tMin;
+        float Exit = tMax;
+        for (int a = 0; a < 3; ++a)
+        {
+            float Near = (Node.Origin[a] + Planes[NearSide[a]][a][i] * Scales[a] - Origin[a]) * InvDir[a];
+            float Far = (Node.Origin[a] + Planes[1 - NearSide[a]][a][i] * Scales[a] - Origin[a]) * InvDir[a];
+            Entry = Near > Entry ? Near : Entry;
+            Exit = Far < Exit ? Far : Exit;
+        }
+        OutEntries[i] = Entry;
+        Mask |= (Entry < Exit ? 1 : 0) << i;
+    }
+    return Mask & Node.ChildMask;
+#endif
+}
+
+bool CompressedBVH::Hit(const Ray& InRay, float tMin, float tMax, HitRecord& Record) const
+{
+    if (Nodes.empty())
+    {
+        return false;
+    }
+
+    const float Origin[3] = { InRay.Origin[0], InRay.Origin[1], InRay.Origin[2] };
+    const float InvDir[3] = { 1.0f / InRay.Dir[0], 1.0f / InRay.Dir[1], 1.0f / InRay.Dir[2] };
+    const int NearSide[3] = { InvDir[0] < 0.0f, InvDir[1] < 0.0f, InvDir[2] < 0.0f };
+
+    // Degenerate trees deeper than the stack kept on the frame get one sized from their depth
+    StackEntry LocalStack[StackSize];
+    std::vector<StackEntry> DeepStack;
+    StackEntry* Stack = LocalStack;
+    if (3 * Depth + 1 > StackSize)
+    {
+        DeepStack.resize(3 * Depth + 1);
+        Stack = DeepStack.data();
+    }
+    int StackTop = 0;
+    Stack[StackTop++] = { 0, 0, tMin };
+
+    HitRecord TempRecord;
+    bool bHitAnything = false;
+
+    while (StackTop > 0)
+    {
+        const StackEntry Entry = Stack[--StackTop];
+
+        if (Entry.tEntry >= tMax)
+        {
+            continue;
+        }
+
+        RT_BVH_STAT(CountNodes(1));
+        if (Entry.Count > 0)
+        {
+            RT_BVH_STAT(CountPrimitives(Entry.Count));
+            for (int i = 0; i < Entry.Count; ++i)
+            {
+                if (Primitives[Entry.Child + i]->Hit(InRay, tMin, tMax, TempRecord))
+                {
+                    bHitAnything = true;
+                    tMax = TempRecord.t;
+                    Record = TempRecord;
+                }
+            }
+            continue;
+        }
+
+        const CompressedBVHNode& Node = Nodes[Entry.Child];
+        alignas(16) float Entries[4];
+        RT_BVH_STAT(CountBoxes(4));
+        int Mask = IntersectChildren(Node, Origin, InvDir, NearSide, tMin, tMax, Entries);
+
+        // Push the children hit far to near, the nearest is popped first
+        StackEntry Hits[4];
+        int HitsNum = 0;
+        for (int i = 0; i < 4; ++i)
+        {
+            if (Mask & (1 << i))
+            {
+                StackEntry Child = { Node.Children[i], Node.Counts[i], Entries[i] };
+                int j = HitsNum++;
+                while (j > 0 && Hits[j - 1].tEntry < Child.tEntry)
+                {
+                    Hits[j] = Hits[j - 1];
+                    --j;
+                }
+                Hits[j] = Child;
+            }
+        }
+
+        for (int i = 0; i < HitsNum; ++i)
+        {
+            Stack[StackTop++] = Hits[i];
+        }
+    }
+
+    return bHitAnything;
+}
+
+bool CompressedBVH::BoundingBox(float InTime0, float InTime1, AABB& OutputBox) const
+{
+    OutputBox = Box;
+    return !Nodes.empty();
+}
@@ -0,0 +1,241 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+    #include <pthread.h>
+    #include <sched.h>
+#endif
+
+/// CPUs the process may actually use: the affinity mask, the cgroup CPU quota
+/// and the NUMA node of every CPU. Inside containers hardware_concurrency()
+/// reports the whole machine, which oversubscribes and gets us throttled.
+class CpuTopology
+{
+    public:
+        /// Usable logical CPUs, grouped by NUMA node.
+        std::vector<int> Cpus;
+        /// NUMA node of every entry of Cpus.
+        std::vector<int> CpuNodes;
+        /// cgroup CPU quota in CPUs, 0 when there is none.
+        float QuotaCpus = 0.0f;
+
+        static CpuTopology Detect();
+
+        /// Workers to start: the usable CPUs, limited by the quota.
+        uint32_t GetEffectiveThreadsNum() const;
+
+        int GetNumaNodesNum() const;
+
+        void Print(std::ostream& Out) const;
+
+    private:
+        static std::vector<int> ParseCpuList(const std::string& List);
+        static float ReadQuota();
+};
+
+/// Pin the calling thread on one logical CPU. Returns false when not supported.
+inline bool PinCurrentThread(int Cpu)
+{
+#if defined(__linux__)
+    cpu_set_t Set;
+    CPU_ZERO(&Set);
+    CPU_SET(Cpu, &Set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(Set), &Set) == 0;
+#else
+    (void)Cpu;
+    return false;
+#endif
+}
+
+CpuTopology CpuTopology::Detect()
+{
+    CpuTopology Topology;
+    std::vector<int> Allowed;
+
+#if defined(__linux__)
+    cpu_set_t Set;
+    CPU_ZERO(&Set);
+    if (sched_getaffinity(0, sizeof(Set), &Set) == 0)
+    {
+        for (int Cpu = 0; Cpu < CPU_SETSIZE; ++Cpu)
+        {
+            if (CPU_ISSET(Cpu, &Set))
+            {
+                Allowed.push_back(Cpu);
+            }
+        }
+    }
+
+    // Group the allowed CPUs by NUMA node, so consecutive workers share a socket
+    for (int Node = 0; ; ++Node)
+    {
+        std::ifstream NodeCpus("/sys/devices/system/node/node" + std::to_string(Node) + "/cpulist");
+        if (!NodeCpus)
+        {
+            break;
+        }
+
+        std::string List;
+        std::getline(NodeCpus, List);
+        for (int Cpu : ParseCpuList(List))
+        {
+            if (std::find(Allowed.begin(), Allowed.end(), Cpu) != Allowed.end())
+            {
+                Topology.Cpus.push_back(Cpu);
+                Topology.CpuNodes.push_back(Node);
+            }
+        }
+    }
+
+    Topology.QuotaCpus = ReadQuota();
+#endif
+
+    // No NUMA information (or not Linux): every CPU on node 0
+    if (Topology.Cpus.size() != Allowed.size() || Allowed.empty())
+    {
+        if (Allowed.empty())
+        {
+            uint32_t HardwareThreads = std::thread::hardware_concurrency();
+            for (uint32_t Cpu = 0; Cpu < (HardwareThreads == 0 ? 8 : HardwareThreads); ++Cpu)
+            {
+                Allowed.push_back(static_cast<int>(Cpu));
+            }
+        }
+
+        Topology.Cpus = Allowed;
+        Topology.CpuNodes.assign(Allowed.size(), 0);
+    }
+
+    return Topology;
+}
+
+uint32_t CpuTopology::GetEffectiveThreadsNum() const
+{
+    uint32_t ThreadsNum = static_cast<uint32_t>(std::max<size_t>(Cpus.size(), 1));
+    if (QuotaCpus > 0.0f)
+    {
+        ThreadsNum = std::min(ThreadsNum, static_cast<uint32_t>(std::max(1.0f, std::ceil(QuotaCpus))));
+    }
+    return ThreadsNum;
+}
+
+int CpuTopology::GetNumaNodesNum() const
+{
+    return CpuNodes.empty() ? 1 : *std::max_element(CpuNodes.begin(), CpuNodes.end()) + 1;
+}
+
+void CpuTopology::Print(std::ostream& Out) const
+{
+    Out << "CPUs: " << Cpus.size() << " usable on " << GetNumaNodesNum() << " NUMA node(s)";
+    if (QuotaCpus > 0.0f)
+    {
+        Out << ", cgroup quota " << QuotaCpus << " CPUs";
+    }
+    Out << '\n';
+}
+
+std::vector<int> CpuTopology::ParseCpuList(const std::string& List)
+{
+    // "0-3,8-11,16"
+    std::vector<int> Result;
+    std::stringstream Stream(List);
+    std::string Range;
+
+    while (std::getline(Stream, Range, ','))
+    {
+        if (Range.empty())
+        {
+            continue;
+        }
+
+        size_t Dash = Range.find('-');
+        int First = std::atoi(Range.substr(0, Dash).c_str());
+        int Last = Dash == std::string::npos ? First : std::atoi(Range.substr(Dash + 1).c_str());
+        for (int Cpu = First; Cpu <= Last; ++Cpu)
+        {
+            Result.push_back(Cpu);
+        }
+    }
+
+    return Result;
+}
+
+float CpuTopology::ReadQuota()
+{
+    // cgroup v2: "<quota> <period>" or "max <period>". Every group from ours up to
+    // the root may set a limit, container runtimes often put it on a parent, and
+    // the tightest one applies
+    std::string GroupPath;
+    {
+        std::ifstream Groups("/proc/self/cgroup");
+        std::string Line;
+        while (std::getline(Groups, Line))
+        {
+            if (Line.compare(0, 3, "0::") == 0)
+            {
+                GroupPath = Line.substr(3);
+            }
+        }
+    }
+
+    bool bFoundCpuMax = false;
+    float MinQuota = 0.0f;
+    while (true)
+    {
+        while (!GroupPath.empty() && GroupPath.back() == '/')
+        {
+            GroupPath.pop_back();
+        }
+
+        std::ifstream CpuMax("/sys/fs/cgroup" + GroupPath + "/cpu.max");
+        std::string Quota;
+        double Period = 0.0;
+        if (CpuMax >> Quota >> Period)
+        {
+            bFoundCpuMax = true;
+            if (Quota != "max" && Period > 0.0)
+            {
+                const float Cpus = static_cast<float>(std::atof(Quota.c_str()) / Period);
+                MinQuota = MinQuota > 0.0f ? std::min(MinQuota, Cpus) : Cpus;
+            }
+        }
+
+        if (GroupPath.empty())
+        {
+            break;
+        }
+        const size_t Slash = GroupPath.rfind('/');
+        GroupPath.erase(Slash == std::string::npos ? 0 : Slash);
+    }
+
+    if (bFoundCpuMax)
+    {
+        return MinQuota;
+    }
+
+    // cgroup v1: quota is -1 when unlimited
+    const std::string V1Paths[] = { "/sys/fs/cgroup/cpu,cpuacct/", "/sys/fs/cgroup/cpu/" };
+    for (const std::string& Path : V1Paths)
+    {
+        std::ifstream QuotaFile(Path + "cpu.cfs_quota_us");
+        std::ifstream PeriodFile(Path + "cpu.cfs_period_us");
+        double Quota = 0.0;
+        double Period = 0.0;
+        if (QuotaFile >> Quota && PeriodFile >> Period)
+        {
+            return Quota <= 0.0 || Period <= 0.0 ? 0.0f : static_cast<float>(Quota / Period);
+        }
+    }
+
+    return 0.0f;
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "RTWeekend.h"
+#include "TileScheduler.h"
+
+/// Single contiguous float image, interleaved channels, rows stored top to bottom
+/// (the layout image writers and denoisers expect). The buffer is one allocation
+/// aligned on a cache line, and every row is padded to whole cache lines, so tiles
+/// whose columns start on a multiple of 16 pixels never share a line.
+///
+/// Pixels are addressed like the camera does: i is the column, j = 0 is the bottom row.
+class FrameBuffer
+{
+    public:
+        static const size_t CacheLineSize = 64;
+
+        FrameBuffer(int InWidth, int InHeight, int InChannels = 3);
+        ~FrameBuffer() { delete[] Allocation; }
+
+        FrameBuffer(const FrameBuffer&) = delete;
+        FrameBuffer& operator=(const FrameBuffer&) = delete;
+
+        inline int GetWidth() const { return Width; }
+        inline int GetHeight() const { return Height; }
+        inline int GetChannels() const { return Channels; }
+
+        /// Floats between two consecutive rows, rounded up to whole cache lines.
+        inline size_t GetRowStride() const
+        {
+            const size_t LineFloats = CacheLineSize / sizeof(float);
+            return (size_t(Width) * Channels + LineFloats - 1) / LineFloats * LineFloats;
+        }
+        inline size_t GetFloatNums() const { return GetRowStride() * Height; }
+
+        inline float* GetData() { return Data; }
+        inline const float* GetData() const { return Data; }
+
+        inline float* GetPixel(int i, int j) { return Data + (Height - 1 - j) * GetRowStride() + size_t(i) * Channels; }
+        inline const float* GetPixel(int i, int j) const { return Data + (Height - 1 - j) * GetRowStride() + size_t(i) * Channels; }
+
+        /// Needs at least 3 channels.
+        inline Color GetColor(int i, int j) const
+        {
+            const float* Pixel = GetPixel(i, j);
+            return Color(Pixel[0], Pixel[1], Pixel[2]);
+        }
+
+        void Clear() { std::memset(Data, 0, GetFloatNums() * sizeof(float)); }
+
+    private:
+        int Width;
+        int Height;
+        int Channels;
+
+        char* Allocation;
+        float* Data;
+};
+
+/// Per-thread accumulation buffer for one tile. Workers fill it and add it to the
+/// FrameBuffer once the tile is done, so they never write into cache lines
+/// another worker is using.
+class TileBuffer
+{
+    public:
+        TileBuffer() : Channels(0) {}
+
+        void Reset(const Tile& InTile, int InChannels)
+        {
+            Bounds = InTile;
+            Channels = InChannels;
+            Data.assign(size_t(InTile.PixelNums()) * Channels, 0.0f);
+        }
+
+        inline const Tile& GetTile() const { return Bounds; }
+        inline int GetChannels() const { return Channels; }
+
+        /// i, j are image coordinates inside the tile.
+        inline float* GetPixel(int i, int j) { return &Data[(size_t(j - Bounds.Y0) * Bounds.Width() + (i - Bounds.X0)) * Channels]; }
+        inline const float* GetPixel(int i, int j) const { return &Data[(size_t(j - Bounds.Y0) * Bounds.Width() + (i - Bounds.X0)) * Channels]; }
+
+        inline void AddColor(int i, int j, const Color& InColor)
+        {
+            float* Pixel = GetPixel(i, j);
+            Pixel[0] += InColor.X();
+            Pixel[1] += InColor.Y();
+            Pixel[2] += InColor.Z();
+        }
+
+        /// Add the whole tile to the frame buffer. Tiles never overlap, so workers
+        /// can commit concurrently.
+        void CommitTo(FrameBuffer& Target) const;
+
+    private:
+        Tile Bounds;
+        int Channels;
+        std::vector<float> Data;
+};
+
+FrameBuffer::FrameBuffer(int InWidth, int InHeight, int InChannels)
+    : Width(InWidth)
+    , Height(InHeight)
+    , Channels(std::max(1, InChannels))
+{
+    // Over-allocate by one cache line and align the data by hand
+    Allocation = new char[GetFloatNums() * sizeof(float) + CacheLineSize];
+    uintptr_t Address = reinterpret_cast<uintptr_t>(Allocation);
+    Address = (Address + CacheLineSize - 1) & ~uintptr_t(CacheLineSize - 1);
+    Data = reinterpret_cast<float*>(Address);
+
+    Clear();
+}
+
+void TileBuffer::CommitTo(FrameBuffer& Target) const
+{
+    const int CommonChannels = std::min(Channels, Target.GetChannels());
+
+    for (int j = Bounds.Y0; j < Bounds.Y1; ++j)
+    {
+        for (int i = Bounds.X0; i < Bounds.X1; ++i)
+        {
+            const float* Src = GetPixel(i, j);
+            float* Dst = Target.GetPixel(i, j);
+            for (int c = 0; c < CommonChannels; ++c)
+            {
+                Dst[c] += Src[c];
+            }
+        }
+    }
+}
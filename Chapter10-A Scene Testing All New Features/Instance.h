@@ -0,0 +1,251 @@
+#pragma once
+
+#include "RTWeekend.h"
+
+#include "Hittable.h"
+#include "LinearBVH.h"
+
+#include <cmath>
+#include <vector>
+
+/// Affine transform from object to world space, a 3x4 matrix kept along with its inverse.
+class Transform
+{
+    public:
+        /// Identity.
+        Transform();
+
+        static Transform Translation(const Vector3& Offset);
+
+        /// Same rotation as RotateY, counterclockwise seen from +y.
+        static Transform RotationY(float Degrees);
+
+        static Transform Scale(const Vector3& Factors);
+
+        /// Applies Right first, then Left.
+        friend Transform operator*(const Transform& Left, const Transform& Right);
+
+        inline Point3 ApplyPoint(const Point3& p) const { return Multiply(Matrix, p, 1.0f); }
+        inline Vector3 ApplyVector(const Vector3& v) const { return Multiply(Matrix, v, 0.0f); }
+        inline Point3 ApplyInversePoint(const Point3& p) const { return Multiply(Inverse, p, 1.0f); }
+        inline Vector3 ApplyInverseVector(const Vector3& v) const { return Multiply(Inverse, v, 0.0f); }
+
+        /// Normals go through the transposed inverse to stay perpendicular to the surface.
+        inline Vector3 ApplyNormal(const Vector3& n) const
+        {
+            return Vector3(
+                Inverse[0][0] * n[0] + Inverse[1][0] * n[1] + Inverse[2][0] * n[2],
+                Inverse[0][1] * n[0] + Inverse[1][1] * n[1] + Inverse[2][1] * n[2],
+                Inverse[0][2] * n[0] + Inverse[1][2] * n[1] + Inverse[2][2] * n[2]);
+        }
+
+        /// World box around the 8 transformed corners.
+        AABB ApplyBox(const AABB& Box) const;
+
+    private:
+        static inline Vector3 Multiply(const float m[3][4], const Vector3& v, float w)
+        {
+            return Vector3(
+                m[0][0] * v[0] + m[0][1] * v[1] + m[0][2] * v[2] + m[0][3] * w,
+                m[1][0] * v[0] + m[1][1] * v[1] + m[1][2] * v[2] + m[1][3] * w,
+                m[2][0] * v[0] + m[2][1] * v[1] + m[2][2] * v[2] + m[2][3] * w);
+        }
+
+        /// Fill Inverse from Matrix.
+        void Invert();
+
+    private:
+        float Matrix[3][4];
+        float Inverse[3][4];
+};
+
+Transform::Transform()
+{
+    for (int Row = 0; Row < 3; ++Row)
+    {
+        for (int Column = 0; Column < 4; ++Column)
+        {
+            Matrix[Row][Column] = Inverse[Row][Column] = Row == Column ? 1.0f : 0.0f;
+        }
+    }
+}
+
+Transform Transform::Translation(const Vector3& Offset)
+{
+    Transform Result;
+    for (int Row = 0; Row < 3; ++Row)
+    {
+        Result.Matrix[Row][3] = Offset[Row];
+        Result.Inverse[Row][3] = -Offset[Row];
+    }
+    return Result;
+}
+
+Transform Transform::RotationY(float Degrees)
+{
+    const float Radians = DegreesToRadians(Degrees);
+    const float SinTheta = sin(Radians);
+    const float CosTheta = cos(Radians);
+
+    Transform Result;
+    Result.Matrix[0][0] = CosTheta;
+    Result.Matrix[0][2] = SinTheta;
+    Result.Matrix[2][0] = -SinTheta;
+    Result.Matrix[2][2] = CosTheta;
+    Result.Invert();
+    return Result;
+}
+
+Transform Transform::Scale(const Vector3& Factors)
+{
+    Transform Result;
+    for (int Row = 0; Row < 3; ++Row)
+    {
+        Result.Matrix[Row][Row] = Factors[Row];
+    }
+    Result.Invert();
+    return Result;
+}
+
+Transform operator*(const Transform& Left, const Transform& Right)
+{
+    Transform Result;
+    for (int Row = 0; Row < 3; ++Row)
+    {
+        for (int Column = 0; Column < 4; ++Column)
+        {
+            float Sum = Column == 3 ? Left.Matrix[Row][3] : 0.0f;
+            for (int k = 0; k < 3; ++k)
+            {
+                Sum += Left.Matrix[Row][k] * Right.Matrix[k][Column];
+            }
+            Result.Matrix[Row][Column] = Sum;
+        }
+    }
+    Result.Invert();
+    return Result;
+}
+
+void Transform::Invert()
+{
+    const float (&m)[3][4] = Matrix;
+
+    // Inverse of the linear part by cofactors, then the translation undone
+    const float Cofactors[3][3] = {
+        { m[1][1] * m[2][2] - m[1][2] * m[2][1], m[1][2] * m[2][0] - m[1][0] * m[2][2], m[1][0] * m[2][1] - m[1][1] * m[2][0] },
+        { m[0][2] * m[2][1] - m[0][1] * m[2][2], m[0][0] * m[2][2] - m[0][2] * m[2][0], m[0][1] * m[2][0] - m[0][0] * m[2][1] },
+        { m[0][1] * m[1][2] - m[0][2] * m[1][1], m[0][2] * m[1][0] - m[0][0] * m[1][2], m[0][0] * m[1][1] - m[0][1] * m[1][0] }
+    };
+    const float Determinant = m[0][0] * Cofactors[0][0] + m[0][1] * Cofactors[0][1] + m[0][2] * Cofactors[0][2];
+    if (Determinant == 0.0f)
+    {
+        std::cerr << "Transform is not invertible.\n";
+        return;
+    }
+
+    for (int Row = 0; Row < 3; ++Row)
+    {
+        for (int Column = 0; Column < 3; ++Column)
+        {
+            Inverse[Row][Column] = Cofactors[Column][Row] / Determinant;
+        }
+    }
+    for (int Row = 0; Row < 3; ++Row)
+    {
+        Inverse[Row][3] = -(Inverse[Row][0] * m[0][3] + Inverse[Row][1] * m[1][3] + Inverse[Row][2] * m[2][3]);
+    }
+}
+
+AABB Transform::ApplyBox(const AABB& Box) const
+{
+    AABB Result = AABB::Empty();
+    for (int Corner = 0; Corner < 8; ++Corner)
+    {
+        Point3 p(
+            Corner & 1 ? Box.Max().X() : Box.Min().X(),
+            Corner & 2 ? Box.Max().Y() : Box.Min().Y(),
+            Corner & 4 ? Box.Max().Z() : Box.Min().Z());
+        Result.Expand(ApplyPoint(p));
+    }
+    return Result;
+}
+
+/// Placement of a shared object, typically a BVH, in the world. Any number of
+/// instances may point at the same object, which is stored once.
+///
+/// The ray goes to object space without renormalizing its direction, so the hit
+/// distances are the same in both spaces.
+class Instance : public Hittable
+{
+    public:
+        Instance(shared_ptr<Hittable> InObject, const Transform& InToWorld)
+            : Object(InObject), ToWorld(InToWorld)
+        {}
+
+        virtual bool Hit(const Ray& InRay, float tMin, float tMax, HitRecord& Record) const override;
+
+        virtual bool BoundingBox(float InTime0, float InTime1, AABB& OutputBox) const override;
+
+        /// Move the instance, the top level holding it must be refitted or rebuilt after.
+        inline void SetTransform(const Transform& InToWorld) { ToWorld = InToWorld; }
+        inline const Transform& GetTransform() const { return ToWorld; }
+        inline const shared_ptr<Hittable>& GetObject() const { return Object; }
+
+    private:
+        shared_ptr<Hittable> Object;
+        Transform ToWorld;
+};
+
+bool Instance::Hit(const Ray& InRay, float tMin, float tMax, HitRecord& Record) const
+{
+    Ray ObjectRay(ToWorld.ApplyInversePoint(InRay.GetOrigin()), ToWorld.ApplyInverseVector(InRay.GetDirection()), InRay.GetTime());
+    if (!Object->Hit(ObjectRay, tMin, tMax, Record))
+    {
+        return false;
+    }
+
+    // The normal keeps its side relative to the ray, bFrontFace stays valid
+    Record.p = ToWorld.ApplyPoint(Record.p);
+    Record.Normal = UnitVector(ToWorld.ApplyNormal(Record.Normal));
+
+    return true;
+}
+
+bool Instance::BoundingBox(float InTime0, float InTime1, AABB& OutputBox) const
+{
+    AABB ObjectBox;
+    if (!Object->BoundingBox(InTime0, InTime1, ObjectBox))
+    {
+        return false;
+    }
+
+    OutputBox = ToWorld.ApplyBox(ObjectBox);
+    return true;
+}
+
+/// Top level of a two-level structure: a BVH over instances whose objects are
+/// bottom-level BVHs. Moving instances only touches the top level, which has
+/// one primitive per instance, the bottom levels are never rebuilt.
+class TopLevelBVH : public LinearBVH
+{
+    public:
+        TopLevelBVH(
+            const std::vector<shared_ptr<Instance>>& InInstances, float Time0, float Time1,
+            const BVHBuildOptions& InOptions = BVHBuildOptions())
+            : LinearBVH(std::vector<shared_ptr<Hittable>>(InInstances.begin(), InInstances.end()), 0, InInstances.size(), Time0, Time1, InOptions)
+            , Instances(InInstances)
+        {}
+
+        inline const std::vector<shared_ptr<Instance>>& GetInstances() const { return Instances; }
+
+        /// Move instance Index, the tree follows on the next Update.
+        inline void SetTransform(size_t Index, const Transform& InToWorld) { Instances[Index]->SetTransform(InToWorld); }
+
+        /// Follow the instances moved since the last update: refit the top level,
+        /// or rebuild it once refitting has degraded it too much.
+        /// @return false if it was rebuilt.
+        inline bool Update(float Time0, float Time1) { return Refit(Time0, Time1); }
+
+    private:
+        std::vector<shared_ptr<Instance>> Instances;
+};
@@ -0,0 +1,358 @@
+#pragma once
+
+#include "RTWeekend.h"
+
+#include "AABB.h"
+#include "BVHBuilder.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+/// Spread the low 10 bits of Value so there are two zero bits between them.
+inline uint32_t SpreadBits10(uint32_t Value)
+{
+    Value &= 0x3FF;
+    Value = (Value | (Value << 16)) & 0x030000FF;
+    Value = (Value | (Value << 8)) & 0x0300F00F;
+    Value = (Value | (Value << 4)) & 0x030C30C3;
+    Value = (Value | (Value << 2)) & 0x09249249;
+    return Value;
+}
+
+/// Spread the low 21 bits of Value so there are two zero bits between them.
+inline uint64_t SpreadBits21(uint64_t Value)
+{
+    Value &= 0x1FFFFF;
+    Value = (Value | (Value << 32)) & 0x001F00000000FFFFull;
+    Value = (Value | (Value << 16)) & 0x001F0000FF0000FFull;
+    Value = (Value | (Value << 8)) & 0x100F00F00F00F00Full;
+    Value = (Value | (Value << 4)) & 0x10C30C30C30C30C3ull;
+    Value = (Value | (Value << 2)) & 0x1249249249249249ull;
+    return Value;
+}
+
+/// Linear BVH builder (LBVH): primitives are sorted along a Morton curve by the
+/// code of their centroid, with a parallel radix sort, and the hierarchy is read
+/// off the sorted codes by splitting at the highest differing bit. It builds far
+/// faster than the SAH, which matters when the tree is rebuilt every frame, but
+/// the splits ignore the primitive sizes.
+///
+/// HLBVH builds the same subtrees inside the cells of the top 12 bits and puts
+/// a binned SAH tree over the cells, which fixes most of the quality loss (the
+/// top levels are the ones nearly every ray visits).
+///
+/// The bit of the code decides the split axis: x is in bits 3k + 2, y in 3k + 1, z in 3k.
+class LBVHBuilder
+{
+    public:
+        LBVHBuilder(const std::vector<AABB>& InPrimitiveBounds, const BVHBuildOptions& InOptions = BVHBuildOptions());
+
+        BVHBuildResult Build();
+
+    private:
+        struct MortonPrimitive
+        {
+            uint64_t Code;
+            uint32_t Index;
+        };
+
+        void ComputeCodes();
+
+        /// Stable LSD radix sort, 8 bits per pass over the used bits.
+        void SortCodes();
+
+        /// Node of the primitives [Begin, End) which share all the bits above Bit.
+        void EmitNode(uint32_t NodeIndex, uint32_t Begin, uint32_t End, int Bit);
+
+        /// Top of the HLBVH: SAH tree over the clusters, copied under Nodes[0].
+        void BuildTopLevels(const std::vector<uint32_t>& ClusterRoots);
+
+        inline uint32_t AllocateNodes(uint32_t Count) { return NodesNum.fetch_add(Count, std::memory_order_relaxed); }
+
+    private:
+        const std::vector<AABB>& PrimitiveBounds;
+        BVHBuildOptions Options;
+        int CodeBits;
+
+        std::vector<MortonPrimitive> Primitives;
+
+        BVHBuildResult Result;
+        std::atomic<uint32_t> NodesNum;
+};
+
+LBVHBuilder::LBVHBuilder(const std::vector<AABB>& InPrimitiveBounds, const BVHBuildOptions& InOptions)
+    : PrimitiveBounds(InPrimitiveBounds)
+    , Options(InOptions)
+    , NodesNum(0)
+{
+    Options.MaxLeafSize = std::max(Options.MaxLeafSize, 1);
+    Options.ParallelChunkSize = std::max(Options.ParallelChunkSize, 1u);
+    CodeBits = Options.MortonBits > 30 ? 63 : 30;
+}
+
+BVHBuildResult LBVHBuilder::Build()
+{
+    Result = BVHBuildResult();
+
+    const uint32_t PrimitiveNums = static_cast<uint32_t>(PrimitiveBounds.size());
+    if (PrimitiveNums == 0)
+    {
+        return Result;
+    }
+
+    ComputeCodes();
+    SortCodes();
+
+    Result.PrimitiveIndices.resize(PrimitiveNums);
+    for (uint32_t i = 0; i < PrimitiveNums; ++i)
+    {
+        Result.PrimitiveIndices[i] = Primitives[i].Index;
+    }
+
+    Result.Nodes.resize(2 * PrimitiveNums - 1);
+    NodesNum.store(1, std::memory_order_relaxed);
+
+    // HLBVH: one subtree per cell of the top 12 bits
+    const int ClusterShift = CodeBits - 12;
+    std::vector<uint32_t> ClusterStarts;
+    if (Options.Method == BVHBuildMethod::HLBVH)
+    {
+        for (uint32_t i = 0; i < PrimitiveNums; ++i)
+        {
+            if (i == 0 || (Primitives[i].Code >> ClusterShift) != (Primitives[i - 1].Code >> ClusterShift))
+            {
+                ClusterStarts.push_back(i);
+            }
+        }
+    }
+
+    if (ClusterStarts.size() <= 1)
+    {
+        EmitNode(0, 0, PrimitiveNums, CodeBits - 1);
+    }
+    else
+    {
+        ClusterStarts.push_back(PrimitiveNums);
+        const uint32_t ClustersNum = static_cast<uint32_t>(ClusterStarts.size() - 1);
+
+        std::vector<uint32_t> ClusterRoots(ClustersNum);
+        TaskGroup Group;
+        for (uint32_t c = 0; c < ClustersNum; ++c)
+        {
+            ClusterRoots[c] = AllocateNodes(1);
+            auto BuildCluster = [this, &ClusterStarts, &ClusterRoots, ClusterShift, c]()
+            {
+                EmitNode(ClusterRoots[c], ClusterStarts[c], ClusterStarts[c + 1], ClusterShift - 1);
+            };
+
+            if (Options.bParallel && ClusterStarts[c + 1] - ClusterStarts[c] >= Options.SubtreeTaskSize)
+            {
+                Group.Run(BuildCluster);
+            }
+            else
+            {
+                BuildCluster();
+            }
+        }
+        Group.Wait();
+
+        BuildTopLevels(ClusterRoots);
+    }
+
+    Result.Nodes.resize(NodesNum.load(std::memory_order_relaxed));
+    Primitives.clear();
+    Primitives.shrink_to_fit();
+
+    return std::move(Result);
+}
+
+void LBVHBuilder::ComputeCodes()
+{
+    const uint32_t PrimitiveNums = static_cast<uint32_t>(PrimitiveBounds.size());
+
+    AABB CentroidBounds = AABB::Empty();
+    for (const AABB& Bounds : PrimitiveBounds)
+    {
+        CentroidBounds.Expand(Bounds.Centroid());
+    }
+
+    const float CellsNum = CodeBits == 63 ? float(1 << 21) : float(1 << 10);
+    const Vector3 Extent = CentroidBounds.Extent();
+
+    Primitives.resize(PrimitiveNums);
+    ParallelFor(PrimitiveNums, [&](int First, int Last)
+    {
+        for (int i = First; i < Last; ++i)
+        {
+            const Point3 Centroid = PrimitiveBounds[i].Centroid();
+
+            uint64_t Cells[3];
+            for (int a = 0; a < 3; ++a)
+            {
+                float Offset = Extent[a] > 0.0f ? (Centroid[a] - CentroidBounds.Min()[a]) / Extent[a] : 0.0f;
+                Cells[a] = static_cast<uint64_t>(std::min(std::max(Offset * CellsNum, 0.0f), CellsNum - 1.0f));
+            }
+
+            Primitives[i].Index = static_cast<uint32_t>(i);
+            Primitives[i].Code = CodeBits == 63
+                ? (SpreadBits21(Cells[0]) << 2) | (SpreadBits21(Cells[1]) << 1) | SpreadBits21(Cells[2])
+                : (uint64_t(SpreadBits10(uint32_t(Cells[0]))) << 2) | (uint64_t(SpreadBits10(uint32_t(Cells[1]))) << 1) | SpreadBits10(uint32_t(Cells[2]));
+        }
+    }, Options.bParallel && PrimitiveNums >= Options.ParallelChunkSize);
+}
+
+void LBVHBuilder::SortCodes()
+{
+    const uint32_t PrimitiveNums = static_cast<uint32_t>(Primitives.size());
+    const uint32_t ChunkSize = Options.ParallelChunkSize;
+    const uint32_t ChunksNum = (PrimitiveNums + ChunkSize - 1) / ChunkSize;
+    const int BucketsNum = 256;
+
+    std::vector<MortonPrimitive> Sorted(PrimitiveNums);
+    std::vector<uint32_t> Offsets(size_t(ChunksNum) * BucketsNum);
+
+    for (int Shift = 0; Shift < CodeBits; Shift += 8)
+    {
+        // Histogram of every chunk
+        std::fill(Offsets.begin(), Offsets.end(), 0u);
+        ForEachBuildChunk(0, PrimitiveNums, ChunkSize, Options.bParallel, [&](uint32_t Chunk, uint32_t First, uint32_t Last)
+        {
+            uint32_t* Histogram = &Offsets[size_t(Chunk) * BucketsNum];
+            for (uint32_t i = First; i < Last; ++i)
+            {
+                Histogram[(Primitives[i].Code >> Shift) & 0xFF]++;
+            }
+        });
+
+        // Bucket major prefix sum, so every chunk writes after the previous ones
+        // in each bucket and the sort stays stable
+        uint32_t Total = 0;
+        for (int b = 0; b < BucketsNum; ++b)
+        {
+            for (uint32_t c = 0; c < ChunksNum; ++c)
+            {
+                uint32_t Count = Offsets[size_t(c) * BucketsNum + b];
+                Offsets[size_t(c) * BucketsNum + b] = Total;
+                Total += Count;
+            }
+        }
+
+        ForEachBuildChunk(0, PrimitiveNums, ChunkSize, Options.bParallel, [&](uint32_t Chunk, uint32_t First, uint32_t Last)
+        {
+            uint32_t* ChunkOffsets = &Offsets[size_t(Chunk) * BucketsNum];
+            for (uint32_t i = First; i < Last; ++i)
+            {
+                Sorted[ChunkOffsets[(Primitives[i].Code >> Shift) & 0xFF]++] = Primitives[i];
+            }
+        });
+
+        Primitives.swap(Sorted);
+    }
+}
+
+void LBVHBuilder::EmitNode(uint32_t NodeIndex, uint32_t Begin, uint32_t End, int Bit)
+{
+    const uint32_t Count = End - Begin;
+    BVHBuildNode& Node = Result.Nodes[NodeIndex];
+
+    if (Count <= static_cast<uint32_t>(Options.MaxLeafSize))
+    {
+        Node.Bounds = AABB::Empty();
+        for (uint32_t i = Begin; i < End; ++i)
+        {
+            Node.Bounds.Expand(PrimitiveBounds[Primitives[i].Index]);
+        }
+        Node.PrimitivesOffset = Begin;
+        Node.PrimitiveCount = Count;
+        return;
+    }
+
+    // Highest bit the primitives do not all share, codes are sorted so the
+    // ones with the bit set are a suffix of the range
+    uint32_t Mid = Begin + Count / 2;
+    int Axis = 0;
+    for (; Bit >= 0; --Bit)
+    {
+        const uint64_t Mask = uint64_t(1) << Bit;
+        if ((Primitives[Begin].Code & Mask) == (Primitives[End - 1].Code & Mask))
+        {
+            continue;
+        }
+
+        auto Split = std::partition_point(Primitives.begin() + Begin, Primitives.begin() + End,
+            [Mask](const MortonPrimitive& Primitive) { return (Primitive.Code & Mask) == 0; });
+        Mid = static_cast<uint32_t>(Split - Primitives.begin());
+        Axis = 2 - Bit % 3;
+        break;
+    }
+
+    // Out of bits (same cell): the middle split above
+    const uint32_t LeftIndex = AllocateNodes(2);
+    const uint32_t RightIndex = LeftIndex + 1;
+    Node.Children[0] = LeftIndex;
+    Node.Children[1] = RightIndex;
+    Node.SplitAxis = Axis;
+
+    if (Options.bParallel && Count >= Options.SubtreeTaskSize)
+    {
+        TaskGroup Group;
+        Group.Run([this, LeftIndex, Begin, Mid, Bit]() { EmitNode(LeftIndex, Begin, Mid, Bit - 1); });
+        EmitNode(RightIndex, Mid, End, Bit - 1);
+        Group.Wait();
+    }
+    else
+    {
+        EmitNode(LeftIndex, Begin, Mid, Bit - 1);
+        EmitNode(RightIndex, Mid, End, Bit - 1);
+    }
+
+    // Nodes was sized up front, the reference is still valid
+    Node.Bounds = Result.Nodes[LeftIndex].Bounds;
+    Node.Bounds.Expand(Result.Nodes[RightIndex].Bounds);
+}
+
+void LBVHBuilder::BuildTopLevels(const std::vector<uint32_t>& ClusterRoots)
+{
+    std::vector<AABB> ClusterBounds(ClusterRoots.size());
+    for (size_t c = 0; c < ClusterRoots.size(); ++c)
+    {
+        ClusterBounds[c] = Result.Nodes[ClusterRoots[c]].Bounds;
+    }
+
+    BVHBuildOptions TopOptions = Options;
+    TopOptions.MaxLeafSize = 1;
+    TopOptions.bParallel = false;
+    BVHBuildResult Top = BVHBuilder(ClusterBounds, TopOptions).Build();
+
+    // Copy the interior nodes, the leaves are replaced by the cluster roots.
+    // The root of the top tree goes to Nodes[0], which was kept for it.
+    std::vector<std::pair<uint32_t, uint32_t>> Pending = { { 0u, 0u } };
+    while (!Pending.empty())
+    {
+        const uint32_t TopIndex = Pending.back().first;
+        const uint32_t NodeIndex = Pending.back().second;
+        Pending.pop_back();
+
+        const BVHBuildNode& Source = Top.Nodes[TopIndex];
+        BVHBuildNode& Node = Result.Nodes[NodeIndex];
+        Node.Bounds = Source.Bounds;
+        Node.SplitAxis = Source.SplitAxis;
+
+        for (int c = 0; c < 2; ++c)
+        {
+            const BVHBuildNode& Child = Top.Nodes[Source.Children[c]];
+            if (Child.IsLeaf())
+            {
+                Node.Children[c] = ClusterRoots[Top.PrimitiveIndices[Child.PrimitivesOffset]];
+            }
+            else
+            {
+                Node.Children[c] = AllocateNodes(1);
+                Pending.push_back({ Source.Children[c], Node.Children[c] });
+            }
+        }
+    }
+}
@@ -0,0 +1,611 @@
+#pragma once
+
+#include "RTWeekend.h"
+
+#include "BVHBuilders.h"
+#include "BVHCache.h"
+#include "Hittable.h"
+#include "HittableList.h"
+#include "ThreadPool.h"
+
+#include <cstdint>
+#include <new>
+#include <vector>
+
+/// 32 bytes, two nodes per cache line. The two children of an interior node are
+/// next to each other at ChildrenOffset, in the same cache line.
+struct alignas(32) LinearBVHNode
+{
+    float BoundsMin[3];
+    float BoundsMax[3];
+    union
+    {
+        int32_t PrimitivesOffset;   // Leaf
+        int32_t ChildrenOffset;     // Interior
+    };
+    uint16_t PrimitiveCount;        // 0 for interior nodes
+    uint8_t Axis;
+    uint8_t Pad;
+
+    inline bool IsLeaf() const { return PrimitiveCount > 0; }
+};
+
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode must stay 32 bytes");
+
+/// Allocates on cache line boundaries, so the sibling pairs are never split.
+template<typename T>
+struct CacheLineAllocator
+{
+    using value_type = T;
+
+    CacheLineAllocator() = default;
+    template<typename U> CacheLineAllocator(const CacheLineAllocator<U>&) {}
+
+    T* allocate(size_t Count) { return static_cast<T*>(::operator new(Count * sizeof(T), std::align_val_t(64))); }
+    void deallocate(T* Pointer, size_t) { ::operator delete(Pointer, std::align_val_t(64)); }
+
+    template<typename U> bool operator==(const CacheLineAllocator<U>&) const { return true; }
+    template<typename U> bool operator!=(const CacheLineAllocator<U>&) const { return false; }
+};
+
+/// BVH flattened in an array, the root first, then the sibling pairs in the order
+/// of BVHBuildOptions::Layout. Hit walks it with a loop and a small stack, the
+/// only virtual calls are on the primitives of the leaves reached. Children are
+/// visited front to back along the split axis.
+///
+/// When objects move, Refit updates the bounds in place instead of rebuilding,
+/// until the tree has degraded too much (see BVHBuildOptions::RefitRebuildRatio).
+///
+/// With BVHBuildOptions::CacheDirectory, the constructor maps the tree built by a
+/// previous run for the same objects instead of building it, and saves it otherwise.
+class LinearBVH : public Hittable
+{
+    public:
+        static const int StackSize = 64;
+
+        LinearBVH(const HittableList& List, float Time0, float Time1, const BVHBuildOptions& InOptions = BVHBuildOptions())
+            : LinearBVH(List.Objects, 0, List.Objects.size(), Time0, Time1, InOptions)
+        {}
+
+        LinearBVH(
+            const std::vector<shared_ptr<Hittable>>& SrcObjects,
+            size_t Start, size_t End, float Time0, float Time1,
+            const BVHBuildOptions& InOptions = BVHBuildOptions());
+
+        // NodeData may point in the own node array
+        LinearBVH(const LinearBVH&) = delete;
+        LinearBVH& operator=(const LinearBVH&) = delete;
+
+        virtual bool Hit(const Ray& InRay, float tMin, float tMax, HitRecord& Record) const override;
+
+        /// Hit, calling OnNodeFetch(NodeIndex) for every node read, e.g. to simulate caches.
+        template<typename FetchFunctor>
+        bool HitTraced(const Ray& InRay, float tMin, float tMax, HitRecord& Record, const FetchFunctor& OnNodeFetch) const;
+
+        virtual bool BoundingBox(float InTime0, float InTime1, AABB& OutputBox) const override;
+
+        /// Build the tree again from the current object bounds.
+        void Rebuild(float Time0, float Time1);
+
+        /// Recompute every node box bottom-up from the current object bounds, keeping
+        /// the topology. Once the SAH cost has grown past RefitRebuildRatio times the
+        /// cost right after the last build, rebuilds instead.
+        /// @return false if the tree was rebuilt.
+        bool Refit(float Time0, float Time1);
+
+        /// SAH cost of the current tree, relative to the root area.
+        inline float GetSAHCost() const { return SAHCost; }
+        inline float GetBuiltSAHCost() const { return BuiltSAHCost; }
+
+        inline const LinearBVHNode* GetNodes() const { return NodeData; }
+        inline size_t GetNodesNum() const { return NodesNum; }
+        inline bool IsFromCache() const { return CacheFile != nullptr; }
+        inline const std::vector<shared_ptr<Hittable>>& GetPrimitives() const { return Primitives; }
+
+        /// Nodes and primitive references, including the objects kept for rebuilds.
+        inline size_t GetMemoryBytes() const
+        {
+            return NodesNum * sizeof(LinearBVHNode) + (Primitives.size() + Objects.size()) * sizeof(shared_ptr<Hittable>);
+        }
+
+    private:
+        /// Build the tree from the current object bounds, from or to the cache if bUseCache.
+        void BuildTree(float Time0, float Time1, bool bUseCache);
+
+        /// Use the tree of a cache file, false if there is none for these objects.
+        bool LoadCache(const std::string& Path, uint64_t SceneHash);
+
+        /// Whether the nodes of a cache file form a tree traversal can walk safely:
+        /// children and leaf ranges in bounds, split axes valid and the stated depth exact.
+        static bool IsValidTree(const LinearBVHNode* InNodes, const BVHCacheHeader& Header);
+
+        /// Place the nodes of the build in Nodes following Options.Layout.
+        void LayOut(const BVHBuildResult& Build);
+
+        /// Copy the build node in Nodes[Offset], but for the children offset.
+        void StoreNode(const BVHBuildResult& Build, uint32_t BuildIndex, int32_t Offset);
+
+        /// Refit the subtree, returns its unnormalized SAH cost.
+        float RefitNode(int32_t Index, float Time0, float Time1, int NodeDepth, int TaskDepth);
+
+        float ComputeSAHCost() const;
+
+        inline float NodeArea(const LinearBVHNode& Node) const
+        {
+            return AABB(Point3(Node.BoundsMin[0], Node.BoundsMin[1], Node.BoundsMin[2]),
+                        Point3(Node.BoundsMax[0], Node.BoundsMax[1], Node.BoundsMax[2])).SurfaceArea();
+        }
+
+        inline float NodeCost(const LinearBVHNode& Node) const
+        {
+            return NodeArea(Node) * (Node.IsLeaf() ? Options.IntersectionCost * Node.PrimitiveCount : Options.TraversalCost);
+        }
+
+    private:
+        // Built nodes, empty while traversing the ones of CacheFile
+        std::vector<LinearBVHNode, CacheLineAllocator<LinearBVHNode>> Nodes;
+        shared_ptr<BVHCacheFile> CacheFile;
+        const LinearBVHNode* NodeData = nullptr;
+        size_t NodesNum = 0;
+
+        // In leaf order
+        std::vector<shared_ptr<Hittable>> Primitives;
+        AABB Box;
+        int Depth = 0;
+
+        // Kept for rebuilds
+        std::vector<shared_ptr<Hittable>> Objects;
+        BVHBuildOptions Options;
+
+        float SAHCost = 0.0f;
+        float BuiltSAHCost = 0.0f;
+};
+
+/// Slab test against precomputed inverse direction.
+inline bool HitNodeBounds(const LinearBVHNode& Node, const float Origin[3], const float InvDir[3], float tMin, float tMax)
+{
+    for (int a = 0; a < 3; a++)
+    {
+        float t0 = (Node.BoundsMin[a] - Origin[a]) * InvDir[a];
+        float t1 = (Node.BoundsMax[a] - Origin[a]) * InvDir[a];
+        if (InvDir[a] < 0.0f)
+        {
+            std::swap(t0, t1);
+        }
+
+        tMin = t0 > tMin ? t0 : tMin;
+        tMax = t1 < tMax ? t1 : tMax;
+        if (tMax <= tMin)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+LinearBVH::LinearBVH(
+    const std::vector<shared_ptr<Hittable>>& SrcObjects,
+    size_t Start, size_t End, float Time0, float Time1,
+    const BVHBuildOptions& InOptions)
+    : Objects(SrcObjects.begin() + Start, SrcObjects.begin() + End)
+    , Options(InOptions)
+{
+    // Leaf sizes have to fit the 16 bits count
+    Options.MaxLeafSize = std::min(Options.MaxLeafSize, 0xFFFF);
+
+    BuildTree(Time0, Time1, true);
+}
+
+void LinearBVH::Rebuild(float Time0, float Time1)
+{
+    // Rebuilds follow moving objects, their trees are not worth keeping
+    BuildTree(Time0, Time1, false);
+}
+
+void LinearBVH::BuildTree(float Time0, float Time1, bool bUseCache)
+{
+    std::vector<AABB> PrimitiveBounds;
+    CollectPrimitiveBounds(Objects, 0, Objects.size(), Time0, Time1, PrimitiveBounds, Options.bParallel);
+
+    Nodes.clear();
+    CacheFile.reset();
+    NodeData = nullptr;
+    NodesNum = 0;
+    Primitives.clear();
+    Depth = 0;
+    SAHCost = BuiltSAHCost = 0.0f;
+
+    bUseCache = bUseCache && !Options.CacheDirectory.empty() && !Objects.empty();
+    const uint64_t SceneHash = bUseCache ? HashBVHInput(PrimitiveBounds, Options) : 0;
+    const std::string CachePath = bUseCache ? BVHCachePath(Options.CacheDirectory, SceneHash) : std::string();
+    if (bUseCache && LoadCache(CachePath, SceneHash))
+    {
+        return;
+    }
+
+    BVHBuildResult Build = BuildBVH(PrimitiveBounds, Options);
+
+    if (Build.IsEmpty())
+    {
+        std::cerr << "No object in LinearBVH constructor.\n";
+        return;
+    }
+
+    Primitives.reserve(Build.PrimitiveIndices.size());
+    for (uint32_t Index : Build.PrimitiveIndices)
+    {
+        Primitives.push_back(Objects[Index]);
+    }
+
+    LayOut(Build);
+    NodeData = Nodes.data();
+    NodesNum = Nodes.size();
+    Box = Build.Nodes[0].Bounds;
+
+    SAHCost = BuiltSAHCost = ComputeSAHCost();
+
+    if (bUseCache)
+    {
+        BVHCacheFile::Write(CachePath, SceneHash, Nodes.data(), Nodes.size(), sizeof(LinearBVHNode), Build.PrimitiveIndices, Depth);
+    }
+}
+
+bool LinearBVH::LoadCache(const std::string& Path, uint64_t SceneHash)
+{
+    shared_ptr<BVHCacheFile> File = BVHCacheFile::Open(Path, SceneHash, sizeof(LinearBVHNode));
+    if (!File || File->GetHeader().NodesNum == 0)
+    {
+        return false;
+    }
+
+    const BVHCacheHeader& Header = File->GetHeader();
+    if (!IsValidTree(static_cast<const LinearBVHNode*>(File->GetNodes()), Header))
+    {
+        std::cerr << "BVH cache " << Path << " is damaged, rebuilding.\n";
+        return false;
+    }
+
+    const uint32_t* Indices = File->GetPrimitiveIndices();
+    Primitives.reserve(Header.PrimitivesNum);
+    for (uint64_t i = 0; i < Header.PrimitivesNum; ++i)
+    {
+        if (Indices[i] >= Objects.size())
+        {
+            Primitives.clear();
+            return false;
+        }
+        Primitives.push_back(Objects[Indices[i]]);
+    }
+
+    CacheFile = File;
+    NodeData = static_cast<const LinearBVHNode*>(File->GetNodes());
+    NodesNum = Header.NodesNum;
+    Depth = Header.Depth;
+    Box = AABB(Point3(NodeData[0].BoundsMin[0], NodeData[0].BoundsMin[1], NodeData[0].BoundsMin[2]),
+               Point3(NodeData[0].BoundsMax[0], NodeData[0].BoundsMax[1], NodeData[0].BoundsMax[2]));
+    SAHCost = BuiltSAHCost = ComputeSAHCost();
+    return true;
+}
+
+bool LinearBVH::IsValidTree(const LinearBVHNode* InNodes, const BVHCacheHeader& Header)
+{
+    struct Visit
+    {
+        int64_t Index;
+        int NodeDepth;
+    };
+
+    // Children always come after their parent, so the walk ends. Counting the
+    // visits also catches nodes shared by several parents.
+    std::vector<Visit> Stack;
+    Stack.push_back({ 0, 1 });
+    uint64_t VisitsNum = 0;
+    int MaxDepth = 0;
+    while (!Stack.empty())
+    {
+        const Visit Current = Stack.back();
+        Stack.pop_back();
+        if (++VisitsNum > Header.NodesNum)
+        {
+            return false;
+        }
+
+        const LinearBVHNode& Node = InNodes[Current.Index];
+        MaxDepth = std::max(MaxDepth, Current.NodeDepth);
+        if (Node.IsLeaf())
+        {
+            if (Node.PrimitivesOffset < 0 || uint64_t(Node.PrimitivesOffset) + Node.PrimitiveCount > Header.PrimitivesNum)
+            {
+                return false;
+            }
+            continue;
+        }
+
+        if (Node.Axis > 2 || Node.ChildrenOffset <= Current.Index || uint64_t(Node.ChildrenOffset) + 1 >= Header.NodesNum)
+        {
+            return false;
+        }
+        Stack.push_back({ Node.ChildrenOffset, Current.NodeDepth + 1 });
+        Stack.push_back({ Node.ChildrenOffset + 1, Current.NodeDepth + 1 });
+    }
+
+    return MaxDepth == Header.Depth;
+}
+
+bool LinearBVH::Refit(float Time0, float Time1)
+{
+    if (NodesNum == 0)
+    {
+        Rebuild(Time0, Time1);
+        return false;
+    }
+
+    // The mapped file is read-only, refit a copy
+    if (CacheFile)
+    {
+        Nodes.assign(NodeData, NodeData + NodesNum);
+        NodeData = Nodes.data();
+        CacheFile.reset();
+    }
+
+    // Enough tasks for every worker to get a few subtrees
+    int TaskDepth = 0;
+    if (Options.bParallel && Primitives.size() >= Options.SubtreeTaskSize)
+    {
+        for (uint32_t Tasks = 1; Tasks < 4 * ThreadPool::Get().GetThreadsNum(); Tasks *= 2)
+        {
+            TaskDepth++;
+        }
+    }
+
+    const float Cost = RefitNode(0, Time0, Time1, 0, TaskDepth);
+    const LinearBVHNode& Root = Nodes[0];
+    Box = AABB(Point3(Root.BoundsMin[0], Root.BoundsMin[1], Root.BoundsMin[2]),
+               Point3(Root.BoundsMax[0], Root.BoundsMax[1], Root.BoundsMax[2]));
+    SAHCost = Cost / std::max(Box.SurfaceArea(), 1e-20f);
+
+    if (SAHCost > Options.RefitRebuildRatio * BuiltSAHCost)
+    {
+        Rebuild(Time0, Time1);
+        return false;
+    }
+    return true;
+}
+
+float LinearBVH::RefitNode(int32_t Index, float Time0, float Time1, int NodeDepth, int TaskDepth)
+{
+    LinearBVHNode& Node = Nodes[Index];
+    AABB Bounds = AABB::Empty();
+    float Cost = 0.0f;
+
+    if (Node.IsLeaf())
+    {
+        for (int i = 0; i < Node.PrimitiveCount; ++i)
+        {
+            AABB PrimitiveBox;
+            if (Primitives[Node.PrimitivesOffset + i]->BoundingBox(Time0, Time1, PrimitiveBox))
+            {
+                Bounds.Expand(PrimitiveBox);
+            }
+        }
+    }
+    else
+    {
+        const int32_t Children[2] = { Node.ChildrenOffset, Node.ChildrenOffset + 1 };
+        float ChildCosts[2];
+
+        if (NodeDepth < TaskDepth)
+        {
+            TaskGroup Group;
+            Group.Run([&]() { ChildCosts[0] = RefitNode(Children[0], Time0, Time1, NodeDepth + 1, TaskDepth); });
+            ChildCosts[1] = RefitNode(Children[1], Time0, Time1, NodeDepth + 1, TaskDepth);
+            Group.Wait();
+        }
+        else
+        {
+            ChildCosts[0] = RefitNode(Children[0], Time0, Time1, NodeDepth + 1, TaskDepth);
+            ChildCosts[1] = RefitNode(Children[1], Time0, Time1, NodeDepth + 1, TaskDepth);
+        }
+
+        for (int32_t Child : Children)
+        {
+            const LinearBVHNode& ChildNode = Nodes[Child];
+            Bounds.Expand(Point3(ChildNode.BoundsMin[0], ChildNode.BoundsMin[1], ChildNode.BoundsMin[2]));
+            Bounds.Expand(Point3(ChildNode.BoundsMax[0], ChildNode.BoundsMax[1], ChildNode.BoundsMax[2]));
+        }
+        Cost = ChildCosts[0] + ChildCosts[1];
+    }
+
+    for (int a = 0; a < 3; a++)
+    {
+        Node.BoundsMin[a] = Bounds.Min()[a];
+        Node.BoundsMax[a] = Bounds.Max()[a];
+    }
+
+    return Cost + NodeCost(Node);
+}
+
+float LinearBVH::ComputeSAHCost() const
+{
+    float Cost = 0.0f;
+    for (size_t i = 0; i < NodesNum; ++i)
+    {
+        Cost += NodeCost(NodeData[i]);
+    }
+    return NodesNum == 0 ? 0.0f : Cost / std::max(NodeArea(NodeData[0]), 1e-20f);
+}
+
+void LinearBVH::LayOut(const BVHBuildResult& Build)
+{
+    // The root alone, an unused slot, then the pairs: with an aligned array every
+    // pair is exactly one cache line
+    Nodes.assign(Build.Nodes.size() + 1, LinearBVHNode());
+    StoreNode(Build, 0, 0);
+    Nodes[1].PrimitiveCount = 0;
+    Nodes[1].ChildrenOffset = 0;
+    for (int a = 0; a < 3; a++)
+    {
+        Nodes[1].BoundsMin[a] = Infinity;
+        Nodes[1].BoundsMax[a] = -Infinity;
+    }
+
+    struct Placed
+    {
+        uint32_t BuildIndex;
+        int32_t Offset;
+        int NodeDepth;
+    };
+
+    const int TreeletPairs = Options.Layout == BVHNodeLayout::Treelets
+        ? std::max(1, Options.TreeletBytes / static_cast<int>(2 * sizeof(LinearBVHNode)))
+        : 1;
+
+    // Interior nodes whose children start a new treelet. Taken last in first out,
+    // so the treelets follow each other depth first
+    std::vector<Placed> TreeletRoots;
+    if (!Build.Nodes[0].IsLeaf())
+    {
+        TreeletRoots.push_back({ 0, 0, 1 });
+    }
+    Depth = 1;
+
+    int32_t Next = 2;
+    std::vector<Placed> Candidates;
+    while (!TreeletRoots.empty())
+    {
+        Candidates.assign(1, TreeletRoots.back());
+        TreeletRoots.pop_back();
+
+        // Grow the treelet by the pair a ray is the likeliest to need next, the
+        // children of the largest node
+        for (int Pairs = 0; Pairs < TreeletPairs && !Candidates.empty(); ++Pairs)
+        {
+            size_t Largest = 0;
+            for (size_t i = 1; i < Candidates.size(); ++i)
+            {
+                if (Build.Nodes[Candidates[i].BuildIndex].Bounds.SurfaceArea() > Build.Nodes[Candidates[Largest].BuildIndex].Bounds.SurfaceArea())
+                {
+                    Largest = i;
+                }
+            }
+            const Placed Parent = Candidates[Largest];
+            Candidates.erase(Candidates.begin() + Largest);
+
+            Nodes[Parent.Offset].ChildrenOffset = Next;
+            for (int c = 0; c < 2; ++c)
+            {
+                const uint32_t ChildIndex = Build.Nodes[Parent.BuildIndex].Children[c];
+                StoreNode(Build, ChildIndex, Next + c);
+                Depth = std::max(Depth, Parent.NodeDepth + 1);
+                if (!Build.Nodes[ChildIndex].IsLeaf())
+                {
+                    Candidates.push_back({ ChildIndex, Next + c, Parent.NodeDepth + 1 });
+                }
+            }
+            Next += 2;
+        }
+
+        // Pushed backwards, the first child's subtree comes next in memory
+        for (auto It = Candidates.rbegin(); It != Candidates.rend(); ++It)
+        {
+            TreeletRoots.push_back(*It);
+        }
+    }
+}
+
+void LinearBVH::StoreNode(const BVHBuildResult& Build, uint32_t BuildIndex, int32_t Offset)
+{
+    const BVHBuildNode& Source = Build.Nodes[BuildIndex];
+    LinearBVHNode& Node = Nodes[Offset];
+    for (int a = 0; a < 3; a++)
+    {
+        Node.BoundsMin[a] = Source.Bounds.Min()[a];
+        Node.BoundsMax[a] = Source.Bounds.Max()[a];
+    }
+    Node.Axis = static_cast<uint8_t>(Source.SplitAxis);
+    Node.Pad = 0;
+    Node.PrimitiveCount = static_cast<uint16_t>(Source.PrimitiveCount);
+    Node.PrimitivesOffset = Source.IsLeaf() ? static_cast<int32_t>(Source.PrimitivesOffset) : 0;
+}
+
+bool LinearBVH::Hit(const Ray& InRay, float tMin, float tMax, HitRecord& Record) const
+{
+    return HitTraced(InRay, tMin, tMax, Record, [](int32_t) {});
+}
+
+template<typename FetchFunctor>
+bool LinearBVH::HitTraced(const Ray& InRay, float tMin, float tMax, HitRecord& Record, const FetchFunctor& OnNodeFetch) const
+{
+    if (NodesNum == 0)
+    {
+        return false;
+    }
+
+    const float Origin[3] = { InRay.Origin[0], InRay.Origin[1], InRay.Origin[2] };
+    const float InvDir[3] = { 1.0f / InRay.Dir[0], 1.0f / InRay.Dir[1], 1.0f / InRay.Dir[2] };
+    const bool bDirIsNeg[3] = { InvDir[0] < 0.0f, InvDir[1] < 0.0f, InvDir[2] < 0.0f };
+
+    // Degenerate trees deeper than the stack kept on the frame get one sized from their depth
+    int32_t LocalStack[StackSize];
+    std::vector<int32_t> DeepStack;
+    int32_t* Stack = LocalStack;
+    if (Depth > StackSize)
+    {
+        DeepStack.resize(Depth);
+        Stack = DeepStack.data();
+    }
+    int StackTop = 0;
+    int32_t Current = 0;
+
+    HitRecord TempRecord;
+    bool bHitAnything = false;
+
+    while (true)
+    {
+        const LinearBVHNode& Node = NodeData[Current];
+        OnNodeFetch(Current);
+        RT_BVH_STAT(CountNodes(1));
+        RT_BVH_STAT(CountBoxes(1));
+
+        // tMax shrinks to the closest hit, farther subtrees are culled
+        if (HitNodeBounds(Node, Origin, InvDir, tMin, tMax))
+        {
+            if (Node.IsLeaf())
+            {
+                RT_BVH_STAT(CountPrimitives(Node.PrimitiveCount));
+                for (int i = 0; i < Node.PrimitiveCount; ++i)
+                {
+                    if (Primitives[Node.PrimitivesOffset + i]->Hit(InRay, tMin, tMax, TempRecord))
+                    {
+                        bHitAnything = true;
+                        tMax = TempRecord.t;
+                        Record = TempRecord;
+                    }
+                }
+            }
+            else
+            {
+                // Visit the child on the ray's side of the split first, so the far
+                // one is usually culled by the closer hit
+                const int32_t NearSide = bDirIsNeg[Node.Axis] ? 1 : 0;
+                Stack[StackTop++] = Node.ChildrenOffset + 1 - NearSide;
+                Current = Node.ChildrenOffset + NearSide;
+                continue;
+            }
+        }
+
+        if (StackTop == 0)
+        {
+            break;
+        }
+        Current = Stack[--StackTop];
+    }
+
+    return bHitAnything;
+}
+
+bool LinearBVH::BoundingBox(float InTime0, float InTime1, AABB& OutputBox) const
+{
+    OutputBox = Box;
+    return NodesNum > 0;
+}
@@ -10,37 +10,15 @@
 #include "Box.h"
 #include "ConstantMedium.h"
 #include "BVH.h"
-#include "ParallelFor.h"
+#include "LinearBVH.h"
+#include "Instance.h"
+#include "BVHBenchmark.h"
+#include "Renderer.h"
+#include "RendererSelfTest.h"
 #include <chrono>
-#include <atomic>
-
-Color RayColor(const Ray& InRay, const Color& Background, const HittableList& World, int Depth) 
-{
-    // If we've exceeded the ray bounce limit, no more light is gathered.
-    if (Depth <= 0)
-    {
-        return Color(0.0f, 0.0f, 0.0f);
-    }
-        
-    // Object
-    HitRecord Record;
-    // If the ray hits nothing, return the background color.
-    if(!World.Hit(InRay, 0.001f, Infinity, Record)) // Use 0.001f as t to instead of 0.0f to avoid shadow acne cause by super near intersection
-    {
-       return Background;
-    }
-
-    Ray Scattered;
-    Color Attenuation;
-    Color Emitted = Record.Material->Emitted(Record.u, Record.v, Record.p);
-
-    if(!Record.Material->Scatter(InRay, Record, Attenuation, Scattered))
-    {
-        return Emitted;
-    }
-
-    return Emitted + Attenuation * RayColor(Scattered, Background, World, Depth - 1);
-}
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
 
 HittableList RandomScene() 
 {
@@ -208,7 +186,7 @@ HittableList CornellSmoke()
     return Objects;
 }
 
-HittableList FinalScene() 
+HittableList FinalScene(const BVHBuildOptions& BVHOptions) 
 {
     HittableList Boxes1;
     auto Ground = make_shared<Lambertian>(Color(0.48f, 0.83f, 0.53f));
@@ -232,7 +210,9 @@ HittableList FinalScene()
     
     HittableList Objects;
 
-    Objects.Add(make_shared<BVHNode>(Boxes1, 0.0f, 1.0f));
+    // The ground and the sphere cluster are bottom-level BVHs placed by a top-level one
+    std::vector<shared_ptr<Instance>> Instances;
+    Instances.push_back(make_shared<Instance>(make_shared<LinearBVH>(Boxes1, 0.0f, 1.0f, BVHOptions), Transform()));
 
     auto Light = make_shared<DiffuseLight>(Color(7.0f, 7.0f, 7.0f));
     Objects.Add(make_shared<XZRect>(123.0f, 423.0f, 147.0f, 412.0f, 554.0f, Light));
@@ -266,18 +246,179 @@ HittableList FinalScene()
         Boxes2.Add(make_shared<Sphere>(Point3::Random(0.0f, 165.0f), 10.0f, White));
     }
 
-    Objects.Add(make_shared<Translate>(
-        make_shared<RotateY>(
-            make_shared<BVHNode>(Boxes2, 0.0f, 1.0f), 15.0f),
-            Vector3(-100.0f, 270.0f, 395.0f)
-        )
-    );
+    Instances.push_back(make_shared<Instance>(
+        make_shared<LinearBVH>(Boxes2, 0.0f, 1.0f, BVHOptions),
+        Transform::Translation(Vector3(-100.0f, 270.0f, 395.0f)) * Transform::RotationY(15.0f)
+    ));
+
+    Objects.Add(make_shared<TopLevelBVH>(Instances, 0.0f, 1.0f, BVHOptions));
 
     return Objects;
 }
 
-int main()
+void PrintUsage(const char* Program)
+{
+    std::cerr << "Usage: " << Program << " [options] > Image.ppm\n"
+              << "  --scene N              scene to render, 1-8 (default 8, FinalScene)\n"
+              << "  --spp N                samples per pixel\n"
+              << "  --width N              image width, the height follows the aspect ratio\n"
+              << "  --pass-samples N       render progressively, N samples per pixel per pass\n"
+              << "  --snapshot FILE        write the image in progress to FILE between passes\n"
+              << "  --snapshot-interval S  seconds between two snapshots (default: every pass)\n"
+              << "  --time-budget S        render until S seconds are spent (capped by --spp if given)\n"
+              << "  --adaptive T           stop sampling pixels whose relative error is below T\n"
+              << "  --min-spp N            samples every pixel takes before it may stop (default 16)\n"
+              << "  --spp-map FILE         write the samples per pixel as a PGM to FILE\n"
+              << "  --checkpoint FILE      save the render state to FILE between passes and on SIGINT/SIGTERM\n"
+              << "  --checkpoint-interval S  seconds between two checkpoints (default 300)\n"
+              << "  --resume FILE          continue the render saved in FILE\n"
+              << "  --threads N            worker threads (default: CPUs allowed by the affinity mask and cgroup quota)\n"
+              << "  --pin-threads          pin every worker on its own CPU, one NUMA node after the other\n"
+              << "  --bvh-build M          BVH builder: sah (default), lbvh (fastest build), hlbvh or sbvh (spatial splits)\n"
+              << "  --bench-bvh N          compare the BVH layouts on N random spheres instead of rendering\n"
+              << "  --self-test            run the renderer checks instead of rendering, exit status 1 on failure\n"
+              << "  --bvh-layout L         LinearBVH node order: dfs (default) or treelets (4 KiB, fewer page misses)\n"
+              << "  --bvh-cache DIR        keep the built BVHs in DIR and map them back in later runs of the same scene\n"
+              << "  --no-auto-bvh          intersect the objects of the world one by one instead of putting them in a BVH\n"
+              << "  --bvh-stats            print the quality of every BVH built, and the nodes, boxes and primitives\n"
+              << "                         tested per ray when built with RT_BVH_STATS defined\n";
+}
+
+int main(int argc, char* argv[])
 {
+    // Command line
+
+    int SceneIndex = 0;
+    int SamplesPerPixelOverride = 0;
+    int ImageWidthOverride = 0;
+    std::string SampleMapPath;
+    std::string ResumePath;
+    uint32_t ThreadsNum = 0;
+    bool bPinThreads = false;
+    uint32_t BenchPrimitiveNums = 0;
+    bool bSelfTest = false;
+    BVHBuildOptions BVHOptions;
+    RenderSettings Settings;
+
+    for (int Arg = 1; Arg < argc; ++Arg)
+    {
+        const bool bHasValue = Arg + 1 < argc;
+        if (!std::strcmp(argv[Arg], "--scene") && bHasValue)
+        {
+            SceneIndex = std::atoi(argv[++Arg]);
+        }
+        else if (!std::strcmp(argv[Arg], "--spp") && bHasValue)
+        {
+            SamplesPerPixelOverride = std::atoi(argv[++Arg]);
+        }
+        else if (!std::strcmp(argv[Arg], "--width") && bHasValue)
+        {
+            ImageWidthOverride = std::atoi(argv[++Arg]);
+        }
+        else if (!std::strcmp(argv[Arg], "--pass-samples") && bHasValue)
+        {
+            Settings.PassSamples = std::atoi(argv[++Arg]);
+        }
+        else if (!std::strcmp(argv[Arg], "--snapshot") && bHasValue)
+        {
+            Settings.SnapshotPath = argv[++Arg];
+        }
+        else if (!std::strcmp(argv[Arg], "--snapshot-interval") && bHasValue)
+        {
+            Settings.SnapshotInterval = static_cast<float>(std::atof(argv[++Arg]));
+        }
+        else if (!std::strcmp(argv[Arg], "--time-budget") && bHasValue)
+        {
+            Settings.TimeBudget = static_cast<float>(std::atof(argv[++Arg]));
+        }
+        else if (!std::strcmp(argv[Arg], "--adaptive") && bHasValue)
+        {
+            Settings.AdaptiveThreshold = static_cast<float>(std::atof(argv[++Arg]));
+        }
+        else if (!std::strcmp(argv[Arg], "--min-spp") && bHasValue)
+        {
+            Settings.AdaptiveMinSamples = std::atoi(argv[++Arg]);
+        }
+        else if (!std::strcmp(argv[Arg], "--spp-map") && bHasValue)
+        {
+            SampleMapPath = argv[++Arg];
+        }
+        else if (!std::strcmp(argv[Arg], "--checkpoint") && bHasValue)
+        {
+            Settings.CheckpointPath = argv[++Arg];
+        }
+        else if (!std::strcmp(argv[Arg], "--checkpoint-interval") && bHasValue)
+        {
+            Settings.CheckpointInterval = static_cast<float>(std::atof(argv[++Arg]));
+        }
+        else if (!std::strcmp(argv[Arg], "--resume") && bHasValue)
+        {
+            ResumePath = argv[++Arg];
+        }
+        else if (!std::strcmp(argv[Arg], "--threads") && bHasValue)
+        {
+            ThreadsNum = static_cast<uint32_t>(std::max(0, std::atoi(argv[++Arg])));
+        }
+        else if (!std::strcmp(argv[Arg], "--pin-threads"))
+        {
+            bPinThreads = true;
+        }
+        else if (!std::strcmp(argv[Arg], "--bvh-build") && bHasValue)
+        {
+            const char* Method = argv[++Arg];
+            BVHOptions.Method = !std::strcmp(Method, "lbvh") ? BVHBuildMethod::LBVH
+                              : !std::strcmp(Method, "hlbvh") ? BVHBuildMethod::HLBVH
+                              : !std::strcmp(Method, "sbvh") ? BVHBuildMethod::SBVH
+                                                             : BVHBuildMethod::BinnedSAH;
+        }
+        else if (!std::strcmp(argv[Arg], "--bvh-layout") && bHasValue)
+        {
+            BVHOptions.Layout = !std::strcmp(argv[++Arg], "treelets") ? BVHNodeLayout::Treelets : BVHNodeLayout::DepthFirst;
+        }
+        else if (!std::strcmp(argv[Arg], "--bvh-cache") && bHasValue)
+        {
+            BVHOptions.CacheDirectory = argv[++Arg];
+        }
+        else if (!std::strcmp(argv[Arg], "--no-auto-bvh"))
+        {
+            Settings.bAutoBVH = false;
+        }
+        else if (!std::strcmp(argv[Arg], "--bvh-stats"))
+        {
+            BVHOptions.bReportStats = true;
+        }
+        else if (!std::strcmp(argv[Arg], "--self-test"))
+        {
+            bSelfTest = true;
+        }
+        else if (!std::strcmp(argv[Arg], "--bench-bvh") && bHasValue)
+        {
+            BenchPrimitiveNums = static_cast<uint32_t>(std::max(1, std::atoi(argv[++Arg])));
+        }
+        else
+        {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    // Workers, before anything submits work to the shared pool
+
+    CpuTopology::Detect().Print(std::cerr);
+    ThreadPool::Configure(ThreadsNum, bPinThreads);
+    std::cerr << "Workers: " << ThreadPool::Get().GetThreadsNum() << (bPinThreads ? " (pinned)" : "") << '\n';
+
+    if (BenchPrimitiveNums > 0)
+    {
+        BVHBenchmark(BenchPrimitiveNums).Run(std::cout);
+        return 0;
+    }
+
+    if (bSelfTest)
+    {
+        return RendererSelfTest::Run(std::cout) ? 0 : 1;
+    }
+
     // Image
 
     auto AspectRatio = 16.0f / 9.0f;
@@ -286,6 +427,10 @@ int main()
     int SamplesPerPixel = 100;
     const int MaxDepth = 50;
 
+    // Tiles handed out to the render workers
+    int TileSize = 16;
+    TileOrder TilesOrder = TileOrder::Hilbert;
+
     // World
     
     HittableList World;
@@ -296,7 +441,7 @@ int main()
     auto Aperture = 0.0f;
     Color Background(0.f, 0.f, 0.f);
 
-    switch(0)
+    switch(SceneIndex)
     {
         case 1:
             World = RandomScene();
@@ -359,11 +504,13 @@ int main()
             break;
         default:
         case 8:
-            World = FinalScene();
+            World = FinalScene(BVHOptions);
             AspectRatio = 1.0f;
             ImageWidth = 800;
             ImageHeight = static_cast<int>(ImageWidth / AspectRatio);
             SamplesPerPixel = 10000;
+            TileSize = 16; // The smallest tiles on whole cache lines, 2500 of them balance the very expensive pixels well
+            TilesOrder = TileOrder::Spiral;
             Background = Color(0.0f, 0.0f, 0.0f);
             LookFrom = Point3(478.0f, 278.0f, -600.0f);
             LookAt = Point3(278.0f, 278.0f, 0.0f);
@@ -379,79 +526,67 @@ int main()
 
     // Render
 
-    std::cout << "P3\n" << ImageWidth << ' ' << ImageHeight << "\n255\n";
-
-    auto StartTime = std::chrono::system_clock::now();
-
-#define MT 1
-#if MT
-    Color** PixelData = new Color*[ImageHeight];
-    for(int i = 0; i < ImageHeight; i++)
+    if (SamplesPerPixelOverride > 0)
+    {
+        SamplesPerPixel = SamplesPerPixelOverride;
+    }
+    else if (Settings.TimeBudget > 0.0f)
     {
-        PixelData[i] = new Color[ImageWidth];
+        // The budget decides when to stop
+        SamplesPerPixel = std::numeric_limits<int>::max();
+    }
+    if (ImageWidthOverride > 0)
+    {
+        ImageWidth = ImageWidthOverride;
+        ImageHeight = static_cast<int>(ImageWidth / AspectRatio);
     }
 
-    const int PixelNums = ImageHeight * ImageWidth;
-    std::atomic<int> FinishedPixelNums(0);
-    
-    auto CalculatePixelJob = [PixelData, SamplesPerPixel, PixelNums, ImageWidth, ImageHeight, &Cam, &Background, &World, &FinishedPixelNums](int Start, int End)
+    Settings.ImageWidth = ImageWidth;
+    Settings.ImageHeight = ImageHeight;
+    Settings.SamplesPerPixel = SamplesPerPixel;
+    Settings.MaxDepth = MaxDepth;
+    Settings.TileSize = TileSize;
+    Settings.TilesOrder = TilesOrder;
+    Settings.SceneId = static_cast<uint32_t>(SceneIndex);
+    Settings.BVHOptions = BVHOptions;
+    if (!ResumePath.empty() && Settings.CheckpointPath.empty())
     {
-        for(int Index = Start; Index < End; Index++)
-        {
-            int i = Index % ImageWidth;
-            int j = Index / ImageWidth;
+        // Keep checkpointing into the file we resume from
+        Settings.CheckpointPath = ResumePath;
+    }
 
-            Color PixelColor(0.0f, 0.0f, 0.0f);
-            // Do antialiasing by random super sampling
-            for (int s = 0; s < SamplesPerPixel; ++s) 
-            {
-                auto u = (i + RandomFloat()) / (ImageWidth - 1);
-                auto v = (j + RandomFloat()) / (ImageHeight - 1);
-                Ray r = Cam.GetRay(u, v);
-                PixelColor += RayColor(r, Background, World, MaxDepth);
-            }
+    auto StartTime = std::chrono::system_clock::now();
 
-            PixelData[i][j] = PixelColor;
+    Renderer SceneRenderer(Settings, Cam, World, Background);
+    if (!ResumePath.empty() && !SceneRenderer.LoadCheckpoint(ResumePath))
+    {
+        return 1;
+    }
 
-            FinishedPixelNums++;
-            std::cerr << "\rProgress: " << (FinishedPixelNums * 1.0f / PixelNums) * 100.0f << ' ' << std::flush;
-        }
-    };
+    // Stop cleanly on Ctrl-C or pre-emption: final checkpoint and partial image
+    std::signal(SIGINT, [](int) { Renderer::RequestStop(); });
+    std::signal(SIGTERM, [](int) { Renderer::RequestStop(); });
 
-    ParallelFor(PixelNums, CalculatePixelJob, true);
+    SceneRenderer.Render();
+    SceneRenderer.WriteImage(std::cout);
 
-    for (int j = ImageHeight - 1; j >= 0; --j) 
+    if (!SampleMapPath.empty())
     {
-        for (int i = 0; i < ImageWidth; ++i) 
-        {
-            WriteColor(std::cout, PixelData[i][j], SamplesPerPixel);
-        }
+        std::ofstream SampleMap(SampleMapPath);
+        SceneRenderer.WriteSampleMap(SampleMap);
     }
 
-    for(int i = 0;i < ImageHeight;i++)
+    SceneRenderer.PrintSampleStats(std::cerr);
+    if (BVHOptions.bReportStats)
     {
-        delete []PixelData[i];
-    }
-    delete []PixelData;
+#if defined(RT_BVH_STATS)
+        BVHTraversalStats::Print(std::cerr);
 #else
-    for (int j = ImageHeight - 1; j >= 0; --j) 
-    {
-        std::cerr << "\rScanlines remaining: " << j << ' ' << std::flush;
-        for (int i = 0; i < ImageWidth; ++i) 
-        {
-            Color PixelColor(0.0f, 0.0f, 0.0f);
-            // Do antialiasing by random super sampling
-            for (int s = 0; s < SamplesPerPixel; ++s) 
-            {
-                auto u = (i + RandomFloat()) / (ImageWidth - 1);
-                auto v = (j + RandomFloat()) / (ImageHeight - 1);
-                Ray r = Cam.GetRay(u, v);
-                PixelColor += RayColor(r, Background, World, MaxDepth);
-            }
-            WriteColor(std::cout, PixelColor, SamplesPerPixel);
-        }
-    }
+        std::cerr << "BVH traversal statistics need a build with RT_BVH_STATS defined.\n";
 #endif
+    }
+    std::cerr << "Summary: ";
+    SceneRenderer.GetReporter().PrintSummary(std::cerr);
 
     auto EndTime = std::chrono::system_clock::now();
     auto Duration = std::chrono::duration_cast<std::chrono::microseconds>(EndTime - StartTime);
@@ -0,0 +1,356 @@
+#pragma once
+
+#include "RTWeekend.h"
+
+#include "BVHBuilders.h"
+#include "Hittable.h"
+#include "HittableList.h"
+
+#include <cstdint>
+#include <vector>
+
+/// 64 bytes, one cache line. Bounds0 holds at Time0 and Bounds1 at Time1, in
+/// between the box is interpolated linearly. Time split nodes have no box of
+/// their own: their first child covers [Time0, split time], the second child
+/// [split time, Time1], and the ray time picks one of them.
+struct alignas(64) MotionBVHNode
+{
+    float Bounds0Min[3];
+    float Bounds0Max[3];
+    float Bounds1Min[3];
+    float Bounds1Max[3];
+    float Time0;
+    float Time1;
+    union
+    {
+        int32_t PrimitivesOffset;   // Leaf
+        int32_t SecondChildOffset;  // Interior
+    };
+    uint16_t PrimitiveCount;        // 0 for interior nodes
+    uint8_t Axis;
+    uint8_t bTimeSplit;
+
+    inline bool IsLeaf() const { return PrimitiveCount > 0; }
+};
+
+static_assert(sizeof(MotionBVHNode) == 64, "MotionBVHNode must stay 64 bytes");
+
+/// BVH for scenes with moving objects. The boxes of the primitives are taken at
+/// shutter open and close instead of over the whole interval, so a fast object
+/// only inflates the nodes at the time it is actually there. This assumes the
+/// objects move linearly over the shutter, like MovingSphere does.
+///
+/// Where the children of the nodes move apart so much that the interpolated boxes
+/// get loose, the shutter interval is split in two with a tree for each half
+/// (at most MaxTimeSplits times).
+class MotionBVH : public Hittable
+{
+    public:
+        static const int StackSize = 64;
+
+        MotionBVH(const HittableList& List, float Time0, float Time1, const BVHBuildOptions& InOptions = BVHBuildOptions())
+            : MotionBVH(List.Objects, 0, List.Objects.size(), Time0, Time1, InOptions)
+        {}
+
+        MotionBVH(
+            const std::vector<shared_ptr<Hittable>>& SrcObjects,
+            size_t Start, size_t End, float Time0, float Time1,
+            const BVHBuildOptions& InOptions = BVHBuildOptions());
+
+        virtual bool Hit(const Ray& InRay, float tMin, float tMax, HitRecord& Record) const override;
+
+        virtual bool BoundingBox(float InTime0, float InTime1, AABB& OutputBox) const override;
+
+        inline const std::vector<MotionBVHNode>& GetNodes() const { return Nodes; }
+
+        /// Nodes and primitive references of every time segment, including the objects kept for them.
+        inline size_t GetMemoryBytes() const
+        {
+            return Nodes.size() * sizeof(MotionBVHNode) + (Primitives.size() + Objects.size()) * sizeof(shared_ptr<Hittable>);
+        }
+
+        /// Number of shutter intervals the root was cut into.
+        inline int GetTimeSegmentsNum() const { return TimeSegmentsNum; }
+
+    private:
+        /// Append the tree of the objects over [Time0, Time1], returns its offset.
+        int32_t BuildSegment(float Time0, float Time1, int TimeSplitsLeft);
+
+        /// Append the nodes of the build, returns the offset of BuildIndex. Tracks the
+        /// mid-shutter area of the interpolated boxes and of the actual boxes.
+        int32_t Flatten(
+            const BVHBuildResult& Build, uint32_t BuildIndex, uint32_t PrimitivesBase,
+            const std::vector<AABB>& Bounds0, const std::vector<AABB>& Bounds1, float Time0, float Time1,
+            float& InOutLooseArea, float& InOutTightArea, int NodeDepth);
+
+        static inline AABB NodeBoundsAt(const MotionBVHNode& Node, float u)
+        {
+            AABB Bounds;
+            for (int a = 0; a < 3; a++)
+            {
+                Bounds.Minimum[a] = Node.Bounds0Min[a] + u * (Node.Bounds1Min[a] - Node.Bounds0Min[a]);
+                Bounds.Maximum[a] = Node.Bounds0Max[a] + u * (Node.Bounds1Max[a] - Node.Bounds0Max[a]);
+            }
+            return Bounds;
+        }
+
+    private:
+        std::vector<MotionBVHNode> Nodes;
+        // In leaf order, once per time segment
+        std::vector<shared_ptr<Hittable>> Primitives;
+
+        std::vector<shared_ptr<Hittable>> Objects;
+        BVHBuildOptions Options;
+
+        AABB Box;
+        int Depth = 0;
+        int TimeSegmentsNum = 0;
+};
+
+MotionBVH::MotionBVH(
+    const std::vector<shared_ptr<Hittable>>& SrcObjects,
+    size_t Start, size_t End, float Time0, float Time1,
+    const BVHBuildOptions& InOptions)
+    : Objects(SrcObjects.begin() + Start, SrcObjects.begin() + End)
+    , Options(InOptions)
+{
+    Options.MaxLeafSize = std::min(Options.MaxLeafSize, 0xFFFF);
+
+    if (Objects.empty())
+    {
+        std::cerr << "No object in MotionBVH constructor.\n";
+        return;
+    }
+
+    BuildSegment(Time0, Time1, std::max(Options.MaxTimeSplits, 0));
+
+    Box = AABB::Empty();
+    for (const shared_ptr<Hittable>& Object : Objects)
+    {
+        AABB ObjectBox;
+        if (!Object->BoundingBox(Time0, Time1, ObjectBox))
+        {
+            std::cerr << "No bounding box in MotionBVH constructor.\n";
+        }
+        Box.Expand(ObjectBox);
+    }
+}
+
+int32_t MotionBVH::BuildSegment(float Time0, float Time1, int TimeSplitsLeft)
+{
+    // Boxes at both ends of the interval, the tree is built over their average
+    std::vector<AABB> Bounds0;
+    std::vector<AABB> Bounds1;
+    CollectPrimitiveBounds(Objects, 0, Objects.size(), Time0, Time0, Bounds0, Options.bParallel);
+    CollectPrimitiveBounds(Objects, 0, Objects.size(), Time1, Time1, Bounds1, Options.bParallel);
+
+    std::vector<AABB> MidBounds(Objects.size());
+    for (size_t i = 0; i < Objects.size(); ++i)
+    {
+        MidBounds[i] = AABB(0.5f * (Bounds0[i].Min() + Bounds1[i].Min()), 0.5f * (Bounds0[i].Max() + Bounds1[i].Max()));
+    }
+
+    BVHBuildResult Build = BuildBVH(MidBounds, Options);
+
+    const size_t NodesBase = Nodes.size();
+    const size_t PrimitivesBase = Primitives.size();
+    for (uint32_t Index : Build.PrimitiveIndices)
+    {
+        Primitives.push_back(Objects[Index]);
+    }
+
+    float LooseArea = 0.0f;
+    float TightArea = 0.0f;
+    const int32_t Offset = Flatten(Build, 0, static_cast<uint32_t>(PrimitivesBase), Bounds0, Bounds1, Time0, Time1, LooseArea, TightArea, 1);
+
+    // Interpolated boxes much bigger than the actual ones mid-shutter: split the
+    // interval and build each half on its own
+    if (TimeSplitsLeft > 0 && Time1 > Time0 && LooseArea > Options.TimeSplitThreshold * TightArea)
+    {
+        Nodes.resize(NodesBase);
+        Primitives.resize(PrimitivesBase);
+
+        const int32_t SplitOffset = static_cast<int32_t>(Nodes.size());
+        Nodes.emplace_back();
+        Nodes[SplitOffset].Time0 = Time0;
+        Nodes[SplitOffset].Time1 = Time1;
+        Nodes[SplitOffset].PrimitiveCount = 0;
+        Nodes[SplitOffset].Axis = 0;
+        Nodes[SplitOffset].bTimeSplit = 1;
+
+        const float SplitTime = 0.5f * (Time0 + Time1);
+        BuildSegment(Time0, SplitTime, TimeSplitsLeft - 1);
+        Nodes[SplitOffset].SecondChildOffset = BuildSegment(SplitTime, Time1, TimeSplitsLeft - 1);
+        return SplitOffset;
+    }
+
+    TimeSegmentsNum++;
+    return Offset;
+}
+
+int32_t MotionBVH::Flatten(
+    const BVHBuildResult& Build, uint32_t BuildIndex, uint32_t PrimitivesBase,
+    const std::vector<AABB>& Bounds0, const std::vector<AABB>& Bounds1, float Time0, float Time1,
+    float& InOutLooseArea, float& InOutTightArea, int NodeDepth)
+{
+    const BVHBuildNode& Source = Build.Nodes[BuildIndex];
+    Depth = std::max(Depth, NodeDepth);
+
+    const int32_t Offset = static_cast<int32_t>(Nodes.size());
+    Nodes.emplace_back();
+    Nodes[Offset].Time0 = Time0;
+    Nodes[Offset].Time1 = Time1;
+    Nodes[Offset].Axis = static_cast<uint8_t>(Source.SplitAxis);
+    Nodes[Offset].bTimeSplit = 0;
+
+    AABB Box0 = AABB::Empty();
+    AABB Box1 = AABB::Empty();
+
+    if (Source.IsLeaf())
+    {
+        for (uint32_t i = 0; i < Source.PrimitiveCount; ++i)
+        {
+            uint32_t Index = Build.PrimitiveIndices[Source.PrimitivesOffset + i];
+            Box0.Expand(Bounds0[Index]);
+            Box1.Expand(Bounds1[Index]);
+        }
+        Nodes[Offset].PrimitivesOffset = static_cast<int32_t>(PrimitivesBase + Source.PrimitivesOffset);
+        Nodes[Offset].PrimitiveCount = static_cast<uint16_t>(Source.PrimitiveCount);
+    }
+    else
+    {
+        Nodes[Offset].PrimitiveCount = 0;
+
+        // Nodes may reallocate while recursing, never keep a reference across
+        int32_t Children[2];
+        Children[0] = Flatten(Build, Source.Children[0], PrimitivesBase, Bounds0, Bounds1, Time0, Time1, InOutLooseArea, InOutTightArea, NodeDepth + 1);
+        Children[1] = Flatten(Build, Source.Children[1], PrimitivesBase, Bounds0, Bounds1, Time0, Time1, InOutLooseArea, InOutTightArea, NodeDepth + 1);
+        Nodes[Offset].SecondChildOffset = Children[1];
+
+        for (int32_t Child : Children)
+        {
+            const MotionBVHNode& ChildNode = Nodes[Child];
+            Box0.Expand(Point3(ChildNode.Bounds0Min[0], ChildNode.Bounds0Min[1], ChildNode.Bounds0Min[2]));
+            Box0.Expand(Point3(ChildNode.Bounds0Max[0], ChildNode.Bounds0Max[1], ChildNode.Bounds0Max[2]));
+            Box1.Expand(Point3(ChildNode.Bounds1Min[0], ChildNode.Bounds1Min[1], ChildNode.Bounds1Min[2]));
+            Box1.Expand(Point3(ChildNode.Bounds1Max[0], ChildNode.Bounds1Max[1], ChildNode.Bounds1Max[2]));
+        }
+    }
+
+    MotionBVHNode& Node = Nodes[Offset];
+    for (int a = 0; a < 3; a++)
+    {
+        Node.Bounds0Min[a] = Box0.Min()[a];
+        Node.Bounds0Max[a] = Box0.Max()[a];
+        Node.Bounds1Min[a] = Box1.Min()[a];
+        Node.Bounds1Max[a] = Box1.Max()[a];
+    }
+
+    InOutLooseArea += NodeBoundsAt(Node, 0.5f).SurfaceArea();
+    InOutTightArea += Source.Bounds.SurfaceArea();
+
+    return Offset;
+}
+
+bool MotionBVH::Hit(const Ray& InRay, float tMin, float tMax, HitRecord& Record) const
+{
+    if (Nodes.empty())
+    {
+        return false;
+    }
+
+    const float Time = InRay.GetTime();
+    const float Origin[3] = { InRay.Origin[0], InRay.Origin[1], InRay.Origin[2] };
+    const float InvDir[3] = { 1.0f / InRay.Dir[0], 1.0f / InRay.Dir[1], 1.0f / InRay.Dir[2] };
+    const bool bDirIsNeg[3] = { InvDir[0] < 0.0f, InvDir[1] < 0.0f, InvDir[2] < 0.0f };
+
+    // Degenerate trees deeper than the stack kept on the frame get one sized from their depth
+    int32_t LocalStack[StackSize];
+    std::vector<int32_t> DeepStack;
+    int32_t* Stack = LocalStack;
+    if (Depth > StackSize)
+    {
+        DeepStack.resize(Depth);
+        Stack = DeepStack.data();
+    }
+    int StackTop = 0;
+    int32_t Current = 0;
+
+    HitRecord TempRecord;
+    bool bHitAnything = false;
+
+    while (true)
+    {
+        const MotionBVHNode& Node = Nodes[Current];
+        RT_BVH_STAT(CountNodes(1));
+
+        if (Node.bTimeSplit)
+        {
+            // Only the half of the shutter the ray lives in
+            Current = Time < Nodes[Current + 1].Time1 ? Current + 1 : Node.SecondChildOffset;
+            continue;
+        }
+
+        RT_BVH_STAT(CountBoxes(1));
+        const float u = Node.Time1 > Node.Time0 ? (Time - Node.Time0) / (Node.Time1 - Node.Time0) : 0.0f;
+
+        bool bHitBox = true;
+        float tEntry = tMin;
+        float tExit = tMax;
+        for (int a = 0; a < 3 && bHitBox; a++)
+        {
+            const float Min = Node.Bounds0Min[a] + u * (Node.Bounds1Min[a] - Node.Bounds0Min[a]);
+            const float Max = Node.Bounds0Max[a] + u * (Node.Bounds1Max[a] - Node.Bounds0Max[a]);
+            float t0 = ((bDirIsNeg[a] ? Max : Min) - Origin[a]) * InvDir[a];
+            float t1 = ((bDirIsNeg[a] ? Min : Max) - Origin[a]) * InvDir[a];
+            tEntry = t0 > tEntry ? t0 : tEntry;
+            tExit = t1 < tExit ? t1 : tExit;
+            bHitBox = tEntry < tExit;
+        }
+
+        if (bHitBox)
+        {
+            if (Node.IsLeaf())
+            {
+                RT_BVH_STAT(CountPrimitives(Node.PrimitiveCount));
+                for (int i = 0; i < Node.PrimitiveCount; ++i)
+                {
+                    if (Primitives[Node.PrimitivesOffset + i]->Hit(InRay, tMin, tMax, TempRecord))
+                    {
+                        bHitAnything = true;
+                        tMax = TempRecord.t;
+                        Record = TempRecord;
+                    }
+                }
+            }
+            else
+            {
+                if (bDirIsNeg[Node.Axis])
+                {
+                    Stack[StackTop++] = Current + 1;
+                    Current = Node.SecondChildOffset;
+                }
+                else
+                {
+                    Stack[StackTop++] = Node.SecondChildOffset;
+                    Current = Current + 1;
+                }
+                continue;
+            }
+        }
+
+        if (StackTop == 0)
+        {
+            break;
+        }
+        Current = Stack[--StackTop];
+    }
+
+    return bHitAnything;
+}
+
+bool MotionBVH::BoundingBox(float InTime0, float InTime1, AABB& OutputBox) const
+{
+    OutputBox = Box;
+    return !Nodes.empty();
+}
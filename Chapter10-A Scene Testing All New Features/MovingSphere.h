@@ -69,8 +69,8 @@ bool MovingSphere::Hit(const Ray& InRay, float tMin, float tMax, HitRecord& Reco
 
 bool MovingSphere::BoundingBox(float InTime0, float InTime1, AABB& OutputBox) const
 {
-    AABB Box0(Center(Time0) - Vector3(Radius, Radius, Radius), Center(Time0) + Vector3(Radius, Radius, Radius));
-    AABB Box1(Center(Time1) - Vector3(Radius, Radius, Radius), Center(Time1) + Vector3(Radius, Radius, Radius));
+    AABB Box0(Center(InTime0) - Vector3(Radius, Radius, Radius), Center(InTime0) + Vector3(Radius, Radius, Radius));
+    AABB Box1(Center(InTime1) - Vector3(Radius, Radius, Radius), Center(InTime1) + Vector3(Radius, Radius, Radius));
     OutputBox = SurroundingBox(Box0, Box1);
 
     return true;
@@ -1,9 +1,9 @@
 #pragma once
 
 #include <algorithm>
-#include <thread>
 #include <functional>
-#include <vector>
+
+#include "ThreadPool.h"
 
 /// @param[in] TaskSize : size of your for loop
 /// @param[in] Functor(Start, End) :
@@ -16,46 +16,47 @@
 /// @endcode
 /// @param bEnableAsync : enable / disable async.
 ///
+/// The loop is cut into many more batches than there are workers and the batches
+/// are pushed on the shared ThreadPool, so idle workers steal the remaining
+/// batches instead of waiting for the slowest chunk to finish.
 ///
 static void ParallelFor(uint32_t TaskSize,
                   std::function<void (int Start, int End)> Functor,
                   bool bEnableAsync = true)
 {
-    // -------
-    uint32_t ThreadsNum = std::thread::hardware_concurrency();
-    ThreadsNum = ThreadsNum == 0 ? 8 : (ThreadsNum);
-
-    uint32_t BatchSize = TaskSize / ThreadsNum;
-    uint32_t BatchRemainder = TaskSize % ThreadsNum;
-
-    std::vector<std::thread> Threads(ThreadsNum);
-
-    if( bEnableAsync )
+    if (TaskSize == 0)
     {
-        // Multithread execution
-        for(uint32_t i = 0; i < ThreadsNum; ++i)
-        {
-            int Start = i * BatchSize;
-            Threads[i] = std::thread(Functor, Start, Start + BatchSize);
-        }
+        return;
     }
-    else
+
+    if (!bEnableAsync)
     {
         // Single thread execution (for easy debugging)
-        for(uint32_t i = 0; i < ThreadsNum; ++i)
-        {
-            int Start = i * BatchSize;
-            Functor(Start, Start + BatchSize);
-        }
+        Functor(0, TaskSize);
+        return;
     }
 
-    // Deform the elements left
-    int Start = ThreadsNum * BatchSize;
-    Functor(Start, Start + BatchRemainder);
+    ThreadPool& Pool = ThreadPool::Get();
+
+    // -------
+    const uint32_t BatchesPerThread = 16;
+    uint32_t BatchNums = std::min(TaskSize, Pool.GetThreadsNum() * BatchesPerThread);
+    uint32_t BatchSize = TaskSize / BatchNums;
+    uint32_t BatchRemainder = TaskSize % BatchNums;
 
-    // Wait for the other thread to finish their task
-    if( bEnableAsync )
+    // Multithread execution, the calling thread helps until every batch is done
+    TaskGroup Group(Pool);
+    uint32_t Start = 0;
+    for (uint32_t i = 0; i < BatchNums; ++i)
     {
-        std::for_each(Threads.begin(), Threads.end(), std::mem_fn(&std::thread::join));
+        // Spread the elements left over the first batches
+        uint32_t End = Start + BatchSize + (i < BatchRemainder ? 1 : 0);
+        Group.Run([&Functor, Start, End]()
+        {
+            Functor(static_cast<int>(Start), static_cast<int>(End));
+        });
+        Start = End;
     }
-}
\ No newline at end of file
+
+    Group.Wait();
+}
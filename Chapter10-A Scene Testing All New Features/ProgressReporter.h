@@ -0,0 +1,207 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "ThreadPool.h"
+
+/// Render progress and throughput. Workers add to their own cache-line sized
+/// slot of counters (no lock, no shared atomic), and a single reporter thread
+/// sums the slots and prints progress at a fixed rate.
+class ProgressReporter
+{
+    public:
+        /// @param InTotalSamples : samples the render is expected to take, used for percent and ETA.
+        /// @param InInterval : seconds between two progress lines.
+        ProgressReporter(uint64_t InTotalSamples, float InInterval = 0.5f, ThreadPool& InPool = ThreadPool::Get());
+        ~ProgressReporter() { Stop(); }
+
+        ProgressReporter(const ProgressReporter&) = delete;
+        ProgressReporter& operator=(const ProgressReporter&) = delete;
+
+        void Start();
+        void Stop();
+
+        /// Called by the workers whenever they finish some work. Thread safe.
+        inline void Commit(uint64_t Pixels, uint64_t Samples, uint64_t Rays)
+        {
+            int WorkerIndex = Pool.GetWorkerIndex();
+            Counters& Slot = Slots[WorkerIndex >= 0 ? WorkerIndex : SlotsNum - 1];
+            Slot.Pixels.fetch_add(Pixels, std::memory_order_relaxed);
+            Slot.Samples.fetch_add(Samples, std::memory_order_relaxed);
+            Slot.Rays.fetch_add(Rays, std::memory_order_relaxed);
+        }
+
+        inline void SetTotalSamples(uint64_t InTotalSamples) { TotalSamples.store(InTotalSamples, std::memory_order_relaxed); }
+
+        uint64_t GetPixels() const;
+        uint64_t GetSamples() const;
+        uint64_t GetRays() const;
+        double GetElapsedSeconds() const;
+
+        /// One line JSON summary of the counters, for production logs.
+        void PrintSummary(std::ostream& Out) const;
+
+    private:
+        struct alignas(64) Counters
+        {
+            std::atomic<uint64_t> Pixels{0};
+            std::atomic<uint64_t> Samples{0};
+            std::atomic<uint64_t> Rays{0};
+        };
+
+        void ReportLoop();
+        void PrintProgress(std::ostream& Out) const;
+
+    private:
+        ThreadPool& Pool;
+
+        // One slot per worker, the last one is shared by threads outside the pool
+        int SlotsNum;
+        std::unique_ptr<Counters[]> Slots;
+
+        std::atomic<uint64_t> TotalSamples;
+        std::chrono::duration<float> Interval;
+        std::chrono::steady_clock::time_point StartTime;
+        std::chrono::steady_clock::time_point StopTime;
+        std::atomic<bool> bRunning;
+
+        std::thread Reporter;
+        std::mutex StopMutex;
+        std::condition_variable StopCondition;
+        bool bStopping;
+};
+
+ProgressReporter::ProgressReporter(uint64_t InTotalSamples, float InInterval, ThreadPool& InPool)
+    : Pool(InPool)
+    , SlotsNum(static_cast<int>(InPool.GetThreadsNum()) + 1)
+    , Slots(new Counters[InPool.GetThreadsNum() + 1])
+    , TotalSamples(InTotalSamples)
+    , Interval(InInterval)
+    , StartTime(std::chrono::steady_clock::now())
+    , StopTime(StartTime)
+    , bRunning(false)
+    , bStopping(false)
+{}
+
+void ProgressReporter::Start()
+{
+    StartTime = std::chrono::steady_clock::now();
+    bRunning = true;
+    bStopping = false;
+    Reporter = std::thread(&ProgressReporter::ReportLoop, this);
+}
+
+void ProgressReporter::Stop()
+{
+    if (!Reporter.joinable())
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> Lock(StopMutex);
+        bStopping = true;
+    }
+    StopCondition.notify_all();
+    Reporter.join();
+
+    StopTime = std::chrono::steady_clock::now();
+    bRunning = false;
+
+    // Final state of the counters
+    PrintProgress(std::cerr);
+    std::cerr << '\n';
+}
+
+uint64_t ProgressReporter::GetPixels() const
+{
+    uint64_t Sum = 0;
+    for (int i = 0; i < SlotsNum; ++i)
+    {
+        Sum += Slots[i].Pixels.load(std::memory_order_relaxed);
+    }
+    return Sum;
+}
+
+uint64_t ProgressReporter::GetSamples() const
+{
+    uint64_t Sum = 0;
+    for (int i = 0; i < SlotsNum; ++i)
+    {
+        Sum += Slots[i].Samples.load(std::memory_order_relaxed);
+    }
+    return Sum;
+}
+
+uint64_t ProgressReporter::GetRays() const
+{
+    uint64_t Sum = 0;
+    for (int i = 0; i < SlotsNum; ++i)
+    {
+        Sum += Slots[i].Rays.load(std::memory_order_relaxed);
+    }
+    return Sum;
+}
+
+double ProgressReporter::GetElapsedSeconds() const
+{
+    auto EndTime = bRunning ? std::chrono::steady_clock::now() : StopTime;
+    return std::chrono::duration<double>(EndTime - StartTime).count();
+}
+
+void ProgressReporter::ReportLoop()
+{
+    std::unique_lock<std::mutex> Lock(StopMutex);
+    while (!StopCondition.wait_for(Lock, Interval, [this]() { return bStopping; }))
+    {
+        PrintProgress(std::cerr);
+    }
+}
+
+void ProgressReporter::PrintProgress(std::ostream& Out) const
+{
+    const uint64_t Samples = GetSamples();
+    const uint64_t Total = TotalSamples.load(std::memory_order_relaxed);
+    const double Elapsed = GetElapsedSeconds();
+
+    const double Fraction = Total > 0 ? std::min(1.0, double(Samples) / double(Total)) : 0.0;
+    const double SamplesPerSecond = Elapsed > 0.0 ? Samples / Elapsed : 0.0;
+    const double RaysPerSecond = Elapsed > 0.0 ? GetRays() / Elapsed : 0.0;
+    const long long ETA = Fraction > 0.0 ? static_cast<long long>(Elapsed * (1.0 - Fraction) / Fraction) : 0;
+
+    const std::streamsize OldPrecision = Out.precision();
+    Out << "\rProgress: " << std::fixed << std::setprecision(2) << Fraction * 100.0 << "%"
+        << " | ETA " << std::setfill('0')
+        << std::setw(2) << ETA / 3600 << ':' << std::setw(2) << (ETA / 60) % 60 << ':' << std::setw(2) << ETA % 60
+        << std::setfill(' ')
+        << " | " << SamplesPerSecond * 1e-6 << " Msamples/s"
+        << " | " << RaysPerSecond * 1e-6 << " Mrays/s   "
+        << std::defaultfloat << std::setprecision(OldPrecision) << std::flush;
+}
+
+void ProgressReporter::PrintSummary(std::ostream& Out) const
+{
+    const double Elapsed = GetElapsedSeconds();
+    const uint64_t Samples = GetSamples();
+    const uint64_t Rays = GetRays();
+
+    const std::streamsize OldPrecision = Out.precision();
+    Out << std::fixed << std::setprecision(3)
+        << "{\"threads\":" << Pool.GetThreadsNum()
+        << ",\"pixels\":" << GetPixels()
+        << ",\"samples\":" << Samples
+        << ",\"rays\":" << Rays
+        << ",\"seconds\":" << Elapsed
+        << ",\"samples_per_second\":" << (Elapsed > 0.0 ? Samples / Elapsed : 0.0)
+        << ",\"rays_per_second\":" << (Elapsed > 0.0 ? Rays / Elapsed : 0.0)
+        << "}\n" << std::defaultfloat << std::setprecision(OldPrecision);
+}
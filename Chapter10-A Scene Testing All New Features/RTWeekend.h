@@ -1,11 +1,11 @@
 #pragma once
 
 #include <cmath>
+#include <cstdint>
 #include <limits>
 #include <memory>
 #include <iostream>
 #include <vector>
-#include <random>
 #include <algorithm>
 
 // Usings
@@ -26,20 +26,71 @@ inline float DegreesToRadians(float Degrees)
     return Degrees * PI / 180.0f;
 }
 
+// Counter-based random numbers.
+// Each number is a hash of a key and a counter: the key identifies the pixel,
+// the sample and the bounce being traced, the counter is the dimension consumed
+// so far. The stream is therefore the same whatever thread, tile order or
+// machine renders the sample, and the per-thread state is two keys and a
+// counter, 24 bytes with padding.
+
+struct RandomStream
+{
+    uint64_t SampleKey = 0;
+    uint64_t Key = 0;
+    uint32_t Dimension = 0;
+};
+
+inline RandomStream& CurrentRandomStream()
+{
+    static thread_local RandomStream Stream;
+    return Stream;
+}
+
+// SplitMix64 finalizer, a cheap bijective 64 bit hash.
+inline uint64_t MixBits(uint64_t Value)
+{
+    Value ^= Value >> 30;
+    Value *= 0xbf58476d1ce4e5b9ull;
+    Value ^= Value >> 27;
+    Value *= 0x94d049bb133111ebull;
+    Value ^= Value >> 31;
+    return Value;
+}
+
+// Start the random stream of one sample. Call it before tracing the camera ray.
+inline void BeginRandomSample(uint32_t PixelIndex, uint32_t SampleIndex)
+{
+    RandomStream& Stream = CurrentRandomStream();
+    Stream.SampleKey = MixBits((uint64_t(PixelIndex) << 32) | SampleIndex);
+    Stream.Key = Stream.SampleKey;
+    Stream.Dimension = 0;
+}
+
+// Switch to the dimensions of another bounce of the current sample.
+inline void SetRandomBounce(uint32_t Bounce)
+{
+    RandomStream& Stream = CurrentRandomStream();
+    Stream.Key = MixBits(Stream.SampleKey ^ ((uint64_t(Bounce) + 1) * 0x9e3779b97f4a7c15ull));
+    Stream.Dimension = 0;
+}
+
+// Returns 64 random bits and moves to the next dimension.
+inline uint64_t RandomBits()
+{
+    RandomStream& Stream = CurrentRandomStream();
+    return MixBits(Stream.Key + (uint64_t(Stream.Dimension++) + 1) * 0x9e3779b97f4a7c15ull);
+}
+
 // Returns a random real in [0,1).
 inline float RandomFloat() 
 {
-    static std::uniform_real_distribution<float> Distribution(0.0f, 1.0f);
-    static thread_local std::mt19937 Generator;
-    return Distribution(Generator);
+    return static_cast<float>(RandomBits() >> 40) * (1.0f / 16777216.0f);
 }
 
 // Returns a random real in [0,1).
 inline double RandomDouble() 
 {
-    static std::uniform_real_distribution<double> Distribution(0.0, 1.0);
-    static thread_local std::mt19937 Generator;
-    return Distribution(Generator);
+    return static_cast<double>(RandomBits() >> 11) * (1.0 / 9007199254740992.0);
 }
 
 
@@ -0,0 +1,636 @@
+#pragma once
+
+#include "RTWeekend.h"
+
+#include "BVHBuilder.h"
+#include "BVHStats.h"
+#include "Camera.h"
+#include "Color.h"
+#include "FrameBuffer.h"
+#include "HittableList.h"
+#include "LinearBVH.h"
+#include "Material.h"
+#include "MotionBVH.h"
+#include "ProgressReporter.h"
+#include "TileScheduler.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+/// bPrimary tells camera rays from bounces for the BVH traversal statistics.
+Color RayColor(const Ray& InRay, const Color& Background, const Hittable& World, int Depth, uint64_t& RayCount, bool bPrimary = true)
+{
+    // If we've exceeded the ray bounce limit, no more light is gathered.
+    if (Depth <= 0)
+    {
+        return Color(0.0f, 0.0f, 0.0f);
+    }
+
+    RayCount++;
+    SetRandomBounce(Depth);
+    RT_BVH_STAT(BeginRay(bPrimary));
+    (void)bPrimary; // Only read by the statistics
+
+    // Object
+    HitRecord Record;
+    // If the ray hits nothing, return the background color.
+    if(!World.Hit(InRay, 0.001f, Infinity, Record)) // Use 0.001f as t to instead of 0.0f to avoid shadow acne cause by super near intersection
+    {
+       return Background;
+    }
+
+    Ray Scattered;
+    Color Attenuation;
+    Color Emitted = Record.Material->Emitted(Record.u, Record.v, Record.p);
+
+    if(!Record.Material->Scatter(InRay, Record, Attenuation, Scattered))
+    {
+        return Emitted;
+    }
+
+    return Emitted + Attenuation * RayColor(Scattered, Background, World, Depth - 1, RayCount, false);
+}
+
+struct RenderSettings
+{
+    int ImageWidth = 400;
+    int ImageHeight = 225;
+    int SamplesPerPixel = 100;
+    int MaxDepth = 50;
+
+    // Tiles handed out to the render workers. Multiples of 16 pixels keep every tile
+    // row on whole cache lines of the frame buffers, whatever their channel count
+    int TileSize = 16;
+    TileOrder TilesOrder = TileOrder::Hilbert;
+
+    // Progressive rendering: the whole frame gets PassSamples samples per pixel
+    // before the next pass starts. 0 renders every sample of a tile in one go.
+    int PassSamples = 0;
+
+    // Image written between passes, empty for none. A snapshot is written after
+    // a pass once SnapshotInterval seconds went by since the previous one.
+    std::string SnapshotPath;
+    float SnapshotInterval = 0.0f;
+
+    // Wall-clock budget in seconds, 0 for none. Passes are added until the budget
+    // is spent or SamplesPerPixel is reached, whichever comes first.
+    float TimeBudget = 0.0f;
+
+    // Adaptive sampling, 0 for off. A pixel stops sampling once it has at least
+    // AdaptiveMinSamples samples and the relative standard error of its luminance
+    // is below AdaptiveThreshold. SamplesPerPixel is the maximum.
+    float AdaptiveThreshold = 0.0f;
+    int AdaptiveMinSamples = 16;
+
+    // Checkpoint file written between passes every CheckpointInterval seconds,
+    // and when the render is interrupted. Empty for none.
+    std::string CheckpointPath;
+    float CheckpointInterval = 300.0f;
+
+    // Identifies the scene in checkpoints, so a render cannot resume into another one
+    uint32_t SceneId = 0;
+
+    // Worlds of more than AutoBVHMinObjects objects are put in a BVH before rendering,
+    // a MotionBVH if any of them moves during the shutter
+    bool bAutoBVH = true;
+    size_t AutoBVHMinObjects = 4;
+    BVHBuildOptions BVHOptions;
+};
+
+/// Renders a world into a float FrameBuffer holding the sum of the samples of
+/// every pixel, one pass over the tiles after the other.
+class Renderer
+{
+    public:
+        Renderer(const RenderSettings& InSettings, const Camera& InCamera, const HittableList& InWorld, const Color& InBackground);
+
+        void Render();
+
+        /// Ask the render to stop after the tiles in flight, e.g. from a signal handler.
+        static void RequestStop() { StopRequested() = true; }
+        static bool IsStopRequested() { return StopRequested(); }
+
+        /// Accumulation buffers and sample counts in a compact binary file. The
+        /// sample counts are also the RNG position of every pixel, so a resumed
+        /// render continues exactly where the checkpoint left it.
+        bool SaveCheckpoint(const std::string& Path) const;
+        bool LoadCheckpoint(const std::string& Path);
+
+        inline const FrameBuffer& GetImage() const { return Radiance; }
+        inline const std::vector<uint32_t>& GetSampleCounts() const { return SampleCounts; }
+        inline const ProgressReporter& GetReporter() const { return Reporter; }
+
+        inline uint32_t GetSampleCount(int i, int j) const { return SampleCounts[size_t(j) * Settings.ImageWidth + i]; }
+
+        /// Write the image as a PPM, every pixel averaged over the samples it received so far.
+        void WriteImage(std::ostream& Out) const;
+
+        /// Samples per pixel reached over the image.
+        void PrintSampleStats(std::ostream& Out) const;
+
+        /// Write the samples per pixel as a PGM, white being the most sampled pixel.
+        void WriteSampleMap(std::ostream& Out) const;
+
+    private:
+        // Drives single passes to recreate interruptions at a given point
+        friend class RendererSelfTest;
+
+        void RenderPass(int TargetSamples);
+        void RenderTile(const Tile& InTile, int TargetSamples);
+        void WriteSnapshot() const;
+
+        /// BVH over the objects of the world, or null when it is small enough as it is.
+        static shared_ptr<Hittable> Accelerate(const RenderSettings& Settings, const Camera& Cam, const HittableList& InWorld);
+
+        bool IsConverged(uint32_t PixelIndex) const;
+
+        inline bool IsOverBudget() const
+        {
+            return Settings.TimeBudget > 0.0f && std::chrono::steady_clock::now() >= Deadline;
+        }
+
+        inline bool ShouldStop() const { return IsStopRequested() || IsOverBudget(); }
+
+        static std::atomic<bool>& StopRequested()
+        {
+            static std::atomic<bool> bStopRequested(false);
+            return bStopRequested;
+        }
+
+    private:
+        RenderSettings Settings;
+        const Camera& Cam;
+        shared_ptr<Hittable> AcceleratedWorld;
+        const Hittable& World;
+        Color Background;
+
+        FrameBuffer Radiance;
+        FrameBuffer LuminanceMoments; // Sum of the squared sample luminance, for adaptive sampling
+        std::vector<uint32_t> SampleCounts;
+        TileScheduler Scheduler;
+        ProgressReporter Reporter;
+
+        // Samples per pixel of the passes completed so far, an interrupted pass does not count
+        int SamplesDone;
+        std::chrono::steady_clock::time_point Deadline;
+
+        // Pixels that took samples in the current pass
+        std::atomic<uint64_t> ActivePixels;
+};
+
+Renderer::Renderer(const RenderSettings& InSettings, const Camera& InCamera, const HittableList& InWorld, const Color& InBackground)
+    : Settings(InSettings)
+    , Cam(InCamera)
+    , AcceleratedWorld(Accelerate(InSettings, InCamera, InWorld))
+    , World(AcceleratedWorld ? *AcceleratedWorld : static_cast<const Hittable&>(InWorld))
+    , Background(InBackground)
+    , Radiance(InSettings.ImageWidth, InSettings.ImageHeight)
+    , LuminanceMoments(InSettings.ImageWidth, InSettings.ImageHeight, 1)
+    , SampleCounts(size_t(InSettings.ImageWidth) * InSettings.ImageHeight, 0)
+    , Scheduler(InSettings.ImageWidth, InSettings.ImageHeight, InSettings.TileSize, InSettings.TilesOrder)
+    , Reporter(uint64_t(InSettings.ImageWidth) * InSettings.ImageHeight * InSettings.SamplesPerPixel)
+    , SamplesDone(0)
+    , ActivePixels(0)
+{}
+
+inline float Luminance(const Color& InColor)
+{
+    return 0.2126f * InColor.X() + 0.7152f * InColor.Y() + 0.0722f * InColor.Z();
+}
+
+void Renderer::Render()
+{
+    // Without a pass size a time budget or adaptive sampling still need passes to stop between
+    const bool bAdaptive = Settings.AdaptiveThreshold > 0.0f;
+    const int DefaultPassSamples = bAdaptive ? std::max(Settings.AdaptiveMinSamples, 1)
+                                 : Settings.TimeBudget > 0.0f ? 4
+                                 : Settings.SamplesPerPixel;
+
+    // Checkpoints can only be taken between passes
+    const int CheckpointPassSamples = !Settings.CheckpointPath.empty() ? 16 : DefaultPassSamples;
+    const int PassSamples = Settings.PassSamples > 0 ? Settings.PassSamples : std::min(DefaultPassSamples, CheckpointPassSamples);
+
+    uint64_t SamplesLeft = 0;
+    for (uint32_t Count : SampleCounts)
+    {
+        SamplesLeft += Settings.SamplesPerPixel - std::min<uint64_t>(Count, Settings.SamplesPerPixel);
+    }
+    Reporter.SetTotalSamples(SamplesLeft);
+
+    const auto StartTime = std::chrono::steady_clock::now();
+    auto LastSnapshot = StartTime;
+    auto LastCheckpoint = StartTime;
+    Deadline = StartTime + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<float>(Settings.TimeBudget));
+
+    Reporter.Start();
+
+    while (SamplesDone < Settings.SamplesPerPixel && !ShouldStop())
+    {
+        int Samples = std::min(PassSamples, Settings.SamplesPerPixel - SamplesDone);
+        ActivePixels = 0;
+        RenderPass(SamplesDone + Samples);
+        if (ShouldStop())
+        {
+            // Some tiles were skipped, the pass is run again on resume
+            break;
+        }
+        SamplesDone += Samples;
+
+        // Without adaptive sampling no pixel stops early, a pass with nothing to do is one
+        // whose tiles all completed before an interruption, and the next pass still has work
+        if (bAdaptive && ActivePixels == 0)
+        {
+            // Every pixel converged
+            break;
+        }
+
+        auto Now = std::chrono::steady_clock::now();
+        if (Settings.TimeBudget > 0.0f)
+        {
+            // Progress is measured against what the budget will let us render at the current rate
+            float Elapsed = std::chrono::duration<float>(Now - StartTime).count();
+            uint64_t ExpectedSamples = static_cast<uint64_t>(Reporter.GetSamples() * std::max(1.0f, Settings.TimeBudget / Elapsed));
+            Reporter.SetTotalSamples(ExpectedSamples);
+        }
+
+        if (!Settings.SnapshotPath.empty()
+            && SamplesDone < Settings.SamplesPerPixel
+            && std::chrono::duration<float>(Now - LastSnapshot).count() >= Settings.SnapshotInterval)
+        {
+            WriteSnapshot();
+            LastSnapshot = Now;
+        }
+
+        if (!Settings.CheckpointPath.empty()
+            && std::chrono::duration<float>(Now - LastCheckpoint).count() >= Settings.CheckpointInterval)
+        {
+            SaveCheckpoint(Settings.CheckpointPath);
+            LastCheckpoint = Now;
+        }
+    }
+
+    Reporter.Stop();
+
+    if (IsStopRequested())
+    {
+        std::cerr << "Render interrupted.\n";
+        if (!Settings.CheckpointPath.empty())
+        {
+            SaveCheckpoint(Settings.CheckpointPath);
+        }
+    }
+}
+
+void Renderer::RenderPass(int TargetSamples)
+{
+    Scheduler.Dispatch([this, TargetSamples](const Tile& InTile)
+    {
+        RenderTile(InTile, TargetSamples);
+    });
+}
+
+// Brings every pixel of the tile to TargetSamples samples. Pixels left behind by
+// an interrupted pass catch up when a resumed render runs that pass again.
+void Renderer::RenderTile(const Tile& InTile, int TargetSamples)
+{
+    // Once the budget is spent or the render is interrupted the remaining tiles
+    // of the pass are skipped, their pixels simply end up with fewer samples.
+    if (ShouldStop())
+    {
+        return;
+    }
+
+    static thread_local TileBuffer LocalTile;
+    static thread_local TileBuffer LocalMoments;
+    LocalTile.Reset(InTile, Radiance.GetChannels());
+    LocalMoments.Reset(InTile, LuminanceMoments.GetChannels());
+
+    uint64_t TileActivePixels = 0;
+
+    const int ImageWidth = Settings.ImageWidth;
+    const int ImageHeight = Settings.ImageHeight;
+
+    for (int j = InTile.Y0; j < InTile.Y1; ++j)
+    {
+        for (int i = InTile.X0; i < InTile.X1; ++i)
+        {
+            const uint32_t PixelIndex = j * ImageWidth + i;
+            const uint32_t FirstSample = SampleCounts[PixelIndex];
+            const uint32_t Samples = TargetSamples - std::min<uint32_t>(FirstSample, TargetSamples);
+
+            if (Samples == 0 || IsConverged(PixelIndex))
+            {
+                continue;
+            }
+
+            Color PixelColor(0.0f, 0.0f, 0.0f);
+            float LuminanceSquared = 0.0f;
+            uint64_t RayCount = 0;
+            // Do antialiasing by random super sampling
+            for (uint32_t s = FirstSample; s < FirstSample + Samples; ++s)
+            {
+                BeginRandomSample(PixelIndex, s);
+                auto u = (i + RandomFloat()) / (ImageWidth - 1);
+                auto v = (j + RandomFloat()) / (ImageHeight - 1);
+                Ray r = Cam.GetRay(u, v);
+                Color SampleColor = RayColor(r, Background, World, Settings.MaxDepth, RayCount);
+                PixelColor += SampleColor;
+                LuminanceSquared += Luminance(SampleColor) * Luminance(SampleColor);
+            }
+
+            LocalTile.AddColor(i, j, PixelColor);
+            LocalMoments.GetPixel(i, j)[0] += LuminanceSquared;
+            SampleCounts[PixelIndex] += Samples;
+            TileActivePixels++;
+
+            Reporter.Commit(1, Samples, RayCount);
+        }
+    }
+
+    LocalTile.CommitTo(Radiance);
+    LocalMoments.CommitTo(LuminanceMoments);
+    ActivePixels.fetch_add(TileActivePixels, std::memory_order_relaxed);
+}
+
+bool Renderer::IsConverged(uint32_t PixelIndex) const
+{
+    const uint32_t n = SampleCounts[PixelIndex];
+    if (Settings.AdaptiveThreshold <= 0.0f || n < static_cast<uint32_t>(std::max(Settings.AdaptiveMinSamples, 2)))
+    {
+        return false;
+    }
+
+    const int i = PixelIndex % Settings.ImageWidth;
+    const int j = PixelIndex / Settings.ImageWidth;
+
+    const float Mean = Luminance(Radiance.GetColor(i, j)) / n;
+    const float MeanSquared = LuminanceMoments.GetPixel(i, j)[0] / n;
+    const float Variance = std::max(0.0f, (MeanSquared - Mean * Mean) * n / (n - 1));
+    const float StandardError = sqrt(Variance / n);
+
+    // Floor the mean so almost black pixels do not keep sampling forever
+    return StandardError <= Settings.AdaptiveThreshold * std::max(Mean, 0.05f);
+}
+
+void Renderer::WriteImage(std::ostream& Out) const
+{
+    Out << "P3\n" << Settings.ImageWidth << ' ' << Settings.ImageHeight << "\n255\n";
+
+    for (int j = Settings.ImageHeight - 1; j >= 0; --j)
+    {
+        for (int i = 0; i < Settings.ImageWidth; ++i)
+        {
+            WriteColor(Out, Radiance.GetColor(i, j), std::max(GetSampleCount(i, j), 1u));
+        }
+    }
+}
+
+void Renderer::PrintSampleStats(std::ostream& Out) const
+{
+    uint32_t MinSamples = SampleCounts.empty() ? 0 : SampleCounts[0];
+    uint32_t MaxSamples = 0;
+    uint64_t TotalSamples = 0;
+
+    for (uint32_t Count : SampleCounts)
+    {
+        MinSamples = std::min(MinSamples, Count);
+        MaxSamples = std::max(MaxSamples, Count);
+        TotalSamples += Count;
+    }
+
+    Out << "Samples per pixel: min " << MinSamples
+        << ", avg " << double(TotalSamples) / std::max<size_t>(SampleCounts.size(), 1)
+        << ", max " << MaxSamples << '\n';
+}
+
+void Renderer::WriteSampleMap(std::ostream& Out) const
+{
+    uint32_t MaxSamples = 1;
+    for (uint32_t Count : SampleCounts)
+    {
+        MaxSamples = std::max(MaxSamples, Count);
+    }
+
+    Out << "P2\n" << Settings.ImageWidth << ' ' << Settings.ImageHeight << "\n255\n";
+
+    for (int j = Settings.ImageHeight - 1; j >= 0; --j)
+    {
+        for (int i = 0; i < Settings.ImageWidth; ++i)
+        {
+            Out << static_cast<int>(255.0f * GetSampleCount(i, j) / MaxSamples) << '\n';
+        }
+    }
+}
+
+shared_ptr<Hittable> Renderer::Accelerate(const RenderSettings& Settings, const Camera& Cam, const HittableList& InWorld)
+{
+    if (!Settings.bAutoBVH || InWorld.Objects.size() <= Settings.AutoBVHMinObjects)
+    {
+        return nullptr;
+    }
+
+    const float Time0 = Cam.GetShutterOpen();
+    const float Time1 = Cam.GetShutterClose();
+
+    // Objects without a box cannot go in a BVH, leave the list as it is
+    bool bMoving = false;
+    for (const shared_ptr<Hittable>& Object : InWorld.Objects)
+    {
+        AABB Open;
+        AABB Close;
+        if (!Object->BoundingBox(Time0, Time0, Open) || !Object->BoundingBox(Time1, Time1, Close))
+        {
+            std::cerr << "World not accelerated, an object has no bounding box.\n";
+            return nullptr;
+        }
+        for (int a = 0; a < 3; ++a)
+        {
+            bMoving |= Open.Min()[a] != Close.Min()[a] || Open.Max()[a] != Close.Max()[a];
+        }
+    }
+
+    std::cerr << "World of " << InWorld.Objects.size() << " objects put in a " << (bMoving ? "MotionBVH" : "LinearBVH") << '\n';
+    if (bMoving)
+    {
+        return make_shared<MotionBVH>(InWorld, Time0, Time1, Settings.BVHOptions);
+    }
+    return make_shared<LinearBVH>(InWorld, Time0, Time1, Settings.BVHOptions);
+}
+
+/// Move the freshly written TempPath over Path. POSIX renames replace the target
+/// in one step, so Path never goes missing. If the move fails Path is left as it
+/// was and TempPath is removed.
+inline bool ReplaceFile(const std::string& TempPath, const std::string& Path)
+{
+#if defined(_WIN32)
+    // rename does not overwrite there, set the old file aside until the new one is in place
+    const std::string OldPath = Path + ".old";
+    std::remove(OldPath.c_str());
+    const bool bHadOld = std::rename(Path.c_str(), OldPath.c_str()) == 0;
+    const bool bReplaced = std::rename(TempPath.c_str(), Path.c_str()) == 0;
+    if (bHadOld)
+    {
+        if (bReplaced)
+        {
+            std::remove(OldPath.c_str());
+        }
+        else
+        {
+            std::rename(OldPath.c_str(), Path.c_str());
+        }
+    }
+#else
+    const bool bReplaced = std::rename(TempPath.c_str(), Path.c_str()) == 0;
+#endif
+
+    if (!bReplaced)
+    {
+        std::cerr << "\nCannot replace " << Path << " with " << TempPath << ", kept the previous file.\n";
+        std::remove(TempPath.c_str());
+    }
+    return bReplaced;
+}
+
+void Renderer::WriteSnapshot() const
+{
+    // Write next to the target and rename, so viewers never see a half written image
+    const std::string TempPath = Settings.SnapshotPath + ".tmp";
+    {
+        std::ofstream Out(TempPath);
+        if (!Out)
+        {
+            std::cerr << "\nCannot write snapshot " << TempPath << '\n';
+            return;
+        }
+        WriteImage(Out);
+        if (!Out)
+        {
+            std::cerr << "\nCannot write snapshot " << TempPath << '\n';
+            Out.close();
+            std::remove(TempPath.c_str());
+            return;
+        }
+    }
+
+    ReplaceFile(TempPath, Settings.SnapshotPath);
+}
+
+namespace
+{
+    const char CheckpointMagic[4] = { 'R', 'T', 'C', 'K' };
+    const uint32_t CheckpointVersion = 3;
+
+    struct CheckpointHeader
+    {
+        char Magic[4];
+        uint32_t Version;
+        uint32_t SceneId;
+        int32_t Width;
+        int32_t Height;
+        int32_t RadianceChannels;
+        int32_t SamplesDone;
+
+        // Settings the accumulated estimates depend on, a resume must use the same
+        int32_t SamplesPerPixel;
+        int32_t MaxDepth;
+        float AdaptiveThreshold;
+        int32_t AdaptiveMinSamples;
+    };
+}
+
+bool Renderer::SaveCheckpoint(const std::string& Path) const
+{
+    CheckpointHeader Header;
+    std::memcpy(Header.Magic, CheckpointMagic, sizeof(Header.Magic));
+    Header.Version = CheckpointVersion;
+    Header.SceneId = Settings.SceneId;
+    Header.Width = Settings.ImageWidth;
+    Header.Height = Settings.ImageHeight;
+    Header.RadianceChannels = Radiance.GetChannels();
+    Header.SamplesDone = SamplesDone;
+    Header.SamplesPerPixel = Settings.SamplesPerPixel;
+    Header.MaxDepth = Settings.MaxDepth;
+    Header.AdaptiveThreshold = Settings.AdaptiveThreshold;
+    Header.AdaptiveMinSamples = Settings.AdaptiveMinSamples;
+
+    // Same write-and-rename dance as the snapshots, a crash never leaves a torn or missing checkpoint
+    const std::string TempPath = Path + ".tmp";
+    {
+        std::ofstream Out(TempPath, std::ios::binary);
+        Out.write(reinterpret_cast<const char*>(&Header), sizeof(Header));
+        Out.write(reinterpret_cast<const char*>(Radiance.GetData()), Radiance.GetFloatNums() * sizeof(float));
+        Out.write(reinterpret_cast<const char*>(LuminanceMoments.GetData()), LuminanceMoments.GetFloatNums() * sizeof(float));
+        Out.write(reinterpret_cast<const char*>(SampleCounts.data()), SampleCounts.size() * sizeof(uint32_t));
+
+        if (!Out)
+        {
+            std::cerr << "\nCannot write checkpoint " << TempPath << '\n';
+            Out.close();
+            std::remove(TempPath.c_str());
+            return false;
+        }
+    }
+
+    // The previous checkpoint stays until the new one replaces it, or for good if that fails
+    return ReplaceFile(TempPath, Path);
+}
+
+bool Renderer::LoadCheckpoint(const std::string& Path)
+{
+    std::ifstream In(Path, std::ios::binary);
+    if (!In)
+    {
+        std::cerr << "Cannot open checkpoint " << Path << '\n';
+        return false;
+    }
+
+    CheckpointHeader Header;
+    In.read(reinterpret_cast<char*>(&Header), sizeof(Header));
+
+    if (!In || std::memcmp(Header.Magic, CheckpointMagic, sizeof(Header.Magic)) != 0 || Header.Version != CheckpointVersion)
+    {
+        std::cerr << "Not a checkpoint of this renderer version: " << Path << '\n';
+        return false;
+    }
+
+    if (Header.SceneId != Settings.SceneId
+        || Header.Width != Settings.ImageWidth
+        || Header.Height != Settings.ImageHeight
+        || Header.RadianceChannels != Radiance.GetChannels())
+    {
+        std::cerr << "Checkpoint " << Path << " was taken for another scene or resolution.\n";
+        return false;
+    }
+
+    if (Header.SamplesPerPixel != Settings.SamplesPerPixel
+        || Header.MaxDepth != Settings.MaxDepth
+        || Header.AdaptiveThreshold != Settings.AdaptiveThreshold
+        || Header.AdaptiveMinSamples != Settings.AdaptiveMinSamples)
+    {
+        std::cerr << "Checkpoint " << Path << " was taken with other sampling settings (spp " << Header.SamplesPerPixel
+                  << ", max depth " << Header.MaxDepth << ", adaptive " << Header.AdaptiveThreshold
+                  << ", min spp " << Header.AdaptiveMinSamples << ").\n";
+        return false;
+    }
+
+    In.read(reinterpret_cast<char*>(Radiance.GetData()), Radiance.GetFloatNums() * sizeof(float));
+    In.read(reinterpret_cast<char*>(LuminanceMoments.GetData()), LuminanceMoments.GetFloatNums() * sizeof(float));
+    In.read(reinterpret_cast<char*>(SampleCounts.data()), SampleCounts.size() * sizeof(uint32_t));
+
+    if (!In)
+    {
+        std::cerr << "Checkpoint " << Path << " is truncated.\n";
+        Radiance.Clear();
+        LuminanceMoments.Clear();
+        std::fill(SampleCounts.begin(), SampleCounts.end(), 0);
+        return false;
+    }
+
+    SamplesDone = Header.SamplesDone;
+    return true;
+}
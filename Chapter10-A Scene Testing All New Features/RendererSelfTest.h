@@ -0,0 +1,83 @@
+#pragma once
+
+#include "RTWeekend.h"
+
+#include "Camera.h"
+#include "HittableList.h"
+#include "Material.h"
+#include "Renderer.h"
+#include "Sphere.h"
+
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+/// Checks of the renderer that need it stopped at precise points, which signals
+/// cannot hit reliably. Run with --self-test.
+class RendererSelfTest
+{
+    public:
+        /// @return true if every check passed.
+        static bool Run(std::ostream& Out);
+
+    private:
+        /// The interruption lands after the last tile of a pass but before the pass
+        /// is counted: the resumed render runs a pass with nothing left to do, and
+        /// must still go on to SamplesPerPixel.
+        static bool ResumeAtPassEnd(std::ostream& Out);
+};
+
+bool RendererSelfTest::Run(std::ostream& Out)
+{
+    bool bPassed = true;
+    bPassed &= ResumeAtPassEnd(Out);
+    return bPassed;
+}
+
+bool RendererSelfTest::ResumeAtPassEnd(std::ostream& Out)
+{
+    HittableList World;
+    World.Add(make_shared<Sphere>(Point3(0.0f, -100.5f, -1.0f), 100.0f, make_shared<Lambertian>(Color(0.8f, 0.8f, 0.0f))));
+    World.Add(make_shared<Sphere>(Point3(0.0f, 0.0f, -1.0f), 0.5f, make_shared<Lambertian>(Color(0.1f, 0.2f, 0.5f))));
+
+    Camera Cam(Point3(0.0f, 0.0f, 1.0f), Point3(0.0f, 0.0f, -1.0f), Vector3(0.0f, 1.0f, 0.0f), 60.0f, 2.0f, 0.0f, 2.0f, 0.0f, 1.0f);
+    const Color Background(0.7f, 0.8f, 1.0f);
+
+    RenderSettings Settings;
+    Settings.ImageWidth = 32;
+    Settings.ImageHeight = 16;
+    Settings.SamplesPerPixel = 16;
+    Settings.PassSamples = 8;
+    Settings.MaxDepth = 4;
+    Settings.CheckpointPath = "RendererSelfTest.checkpoint";
+
+    {
+        // Every tile of the first pass completed, SamplesDone was not advanced yet
+        Renderer Interrupted(Settings, Cam, World, Background);
+        Interrupted.RenderPass(Settings.PassSamples);
+        if (!Interrupted.SaveCheckpoint(Settings.CheckpointPath))
+        {
+            Out << "Resume at the end of a pass: FAILED, cannot write " << Settings.CheckpointPath << '\n';
+            return false;
+        }
+    }
+
+    Renderer Resumed(Settings, Cam, World, Background);
+    const bool bLoaded = Resumed.LoadCheckpoint(Settings.CheckpointPath);
+    if (bLoaded)
+    {
+        Resumed.Render();
+    }
+    std::remove(Settings.CheckpointPath.c_str());
+
+    uint32_t MinSamples = bLoaded ? ~0u : 0u;
+    for (uint32_t Count : Resumed.GetSampleCounts())
+    {
+        MinSamples = std::min(MinSamples, Count);
+    }
+
+    const bool bPassed = bLoaded && MinSamples == static_cast<uint32_t>(Settings.SamplesPerPixel);
+    Out << "Resume at the end of a pass: " << (bPassed ? "passed" : "FAILED")
+        << " (min " << MinSamples << " samples per pixel, expected " << Settings.SamplesPerPixel << ")\n";
+    return bPassed;
+}
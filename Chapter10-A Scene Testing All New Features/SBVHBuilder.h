@@ -0,0 +1,471 @@
+#pragma once
+
+#include "RTWeekend.h"
+
+#include "AABB.h"
+#include "BVHBuilder.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+/// Spatial split BVH builder (SBVH). Next to the binned object splits, it tries
+/// cutting the node with a plane and sending a primitive to both sides when it
+/// straddles it, each side with its box clipped to that side. Large overlapping
+/// primitives (walls, floors, long boxes) then stop covering the whole tree.
+///
+/// The primitives are arbitrary Hittables, so a reference is clipped as a box,
+/// not as the actual geometry: the clipped box still contains the part of the
+/// primitive on its side, only a bit less tightly than a clipped triangle would.
+///
+/// Leaves may reference a primitive several times across the tree. The extra
+/// references are capped to MaxDuplication times the primitive count.
+class SBVHBuilder
+{
+    public:
+        SBVHBuilder(const std::vector<AABB>& InPrimitiveBounds, const BVHBuildOptions& InOptions = BVHBuildOptions());
+
+        BVHBuildResult Build();
+
+    private:
+        struct Reference
+        {
+            AABB Bounds;
+            uint32_t Index;
+        };
+
+        struct ObjectSplit
+        {
+            int Axis = -1;
+            int BinIndex = 0;
+            float Cost = Infinity;
+            AABB LeftBounds;
+            AABB RightBounds;
+        };
+
+        struct SpatialSplit
+        {
+            int Axis = -1;
+            float Position = 0.0f;
+            float Cost = Infinity;
+        };
+
+        void BuildNode(uint32_t NodeIndex, std::vector<Reference>& References, int Depth);
+
+        ObjectSplit FindObjectSplit(const std::vector<Reference>& References, const AABB& CentroidBounds, float NodeArea) const;
+        SpatialSplit FindSpatialSplit(const std::vector<Reference>& References, const AABB& NodeBounds, float NodeArea) const;
+
+        void PartitionObjects(std::vector<Reference>& References, const ObjectSplit& Split, const AABB& CentroidBounds,
+                              std::vector<Reference>& OutLeft, std::vector<Reference>& OutRight) const;
+        void PartitionSpatial(std::vector<Reference>& References, const SpatialSplit& Split,
+                              std::vector<Reference>& OutLeft, std::vector<Reference>& OutRight);
+
+        inline int CentroidBin(const Point3& Centroid, int Axis, const AABB& CentroidBounds) const
+        {
+            float Extent = CentroidBounds.Max()[Axis] - CentroidBounds.Min()[Axis];
+            int Index = static_cast<int>(Options.BinsNum * (Centroid[Axis] - CentroidBounds.Min()[Axis]) / Extent);
+            return std::min(std::max(Index, 0), Options.BinsNum - 1);
+        }
+
+        /// Part of Bounds on one side of the plane.
+        static inline AABB ClipBelow(const AABB& Bounds, int Axis, float Position)
+        {
+            AABB Clipped = Bounds;
+            Clipped.Maximum[Axis] = std::min(Clipped.Maximum[Axis], Position);
+            return Clipped;
+        }
+
+        static inline AABB ClipAbove(const AABB& Bounds, int Axis, float Position)
+        {
+            AABB Clipped = Bounds;
+            Clipped.Minimum[Axis] = std::max(Clipped.Minimum[Axis], Position);
+            return Clipped;
+        }
+
+    private:
+        const std::vector<AABB>& PrimitiveBounds;
+        BVHBuildOptions Options;
+
+        // Spatial splits are only tried when the object split children overlap
+        // by more than this fraction of the root area
+        float MinOverlapArea = 0.0f;
+        size_t ReferencesBudget = 0;
+        size_t ReferencesNum = 0;
+
+        BVHBuildResult Result;
+};
+
+SBVHBuilder::SBVHBuilder(const std::vector<AABB>& InPrimitiveBounds, const BVHBuildOptions& InOptions)
+    : PrimitiveBounds(InPrimitiveBounds)
+    , Options(InOptions)
+{
+    Options.MaxLeafSize = std::max(Options.MaxLeafSize, 1);
+    Options.BinsNum = std::max(Options.BinsNum, 2);
+    Options.MaxDuplication = std::max(Options.MaxDuplication, 0.0f);
+}
+
+BVHBuildResult SBVHBuilder::Build()
+{
+    Result = BVHBuildResult();
+
+    const size_t PrimitiveNums = PrimitiveBounds.size();
+    if (PrimitiveNums == 0)
+    {
+        return Result;
+    }
+
+    std::vector<Reference> References(PrimitiveNums);
+    AABB RootBounds = AABB::Empty();
+    for (size_t i = 0; i < PrimitiveNums; ++i)
+    {
+        References[i] = { PrimitiveBounds[i], static_cast<uint32_t>(i) };
+        RootBounds.Expand(PrimitiveBounds[i]);
+    }
+
+    MinOverlapArea = Options.SpatialSplitAlpha * RootBounds.SurfaceArea();
+    ReferencesNum = PrimitiveNums;
+    ReferencesBudget = PrimitiveNums + static_cast<size_t>(Options.MaxDuplication * PrimitiveNums);
+
+    Result.Nodes.reserve(2 * PrimitiveNums);
+    Result.PrimitiveIndices.reserve(PrimitiveNums);
+    Result.Nodes.emplace_back();
+    BuildNode(0, References, 1);
+
+    return std::move(Result);
+}
+
+void SBVHBuilder::BuildNode(uint32_t NodeIndex, std::vector<Reference>& References, int Depth)
+{
+    const uint32_t Count = static_cast<uint32_t>(References.size());
+
+    AABB NodeBounds = AABB::Empty();
+    AABB CentroidBounds = AABB::Empty();
+    for (const Reference& Ref : References)
+    {
+        NodeBounds.Expand(Ref.Bounds);
+        CentroidBounds.Expand(Ref.Bounds.Centroid());
+    }
+    Result.Nodes[NodeIndex].Bounds = NodeBounds;
+
+    auto MakeLeaf = [this, NodeIndex, &References]()
+    {
+        Result.Nodes[NodeIndex].PrimitivesOffset = static_cast<uint32_t>(Result.PrimitiveIndices.size());
+        Result.Nodes[NodeIndex].PrimitiveCount = static_cast<uint32_t>(References.size());
+        for (const Reference& Ref : References)
+        {
+            Result.PrimitiveIndices.push_back(Ref.Index);
+        }
+    };
+
+    if (Count == 1)
+    {
+        MakeLeaf();
+        return;
+    }
+
+    const float NodeArea = std::max(NodeBounds.SurfaceArea(), 1e-20f);
+    ObjectSplit Object = FindObjectSplit(References, CentroidBounds, NodeArea);
+
+    // Only look for a spatial split where the object split leaves a real overlap,
+    // while the budget lasts and far from the traversal stack limit
+    SpatialSplit Spatial;
+    if (Object.Axis >= 0 && Depth < 48 && ReferencesNum < ReferencesBudget)
+    {
+        AABB Overlap = Object.LeftBounds;
+        for (int a = 0; a < 3; ++a)
+        {
+            Overlap.Minimum[a] = std::max(Overlap.Minimum[a], Object.RightBounds.Minimum[a]);
+            Overlap.Maximum[a] = std::min(Overlap.Maximum[a], Object.RightBounds.Maximum[a]);
+        }
+
+        if (Overlap.SurfaceArea() > MinOverlapArea)
+        {
+            Spatial = FindSpatialSplit(References, NodeBounds, NodeArea);
+        }
+    }
+
+    const float BestCost = std::min(Object.Cost, Spatial.Cost);
+    const float LeafCost = Options.IntersectionCost * Count;
+    if (Count <= static_cast<uint32_t>(Options.MaxLeafSize) && (BestCost == Infinity || LeafCost <= BestCost))
+    {
+        MakeLeaf();
+        return;
+    }
+
+    std::vector<Reference> Left;
+    std::vector<Reference> Right;
+    int Axis = NodeBounds.MaxAxis();
+
+    if (Spatial.Cost < Object.Cost)
+    {
+        Axis = Spatial.Axis;
+        PartitionSpatial(References, Spatial, Left, Right);
+    }
+
+    // Spatial splits that failed to separate anything fall back on the object split
+    if (Left.empty() || Right.empty())
+    {
+        Left.clear();
+        Right.clear();
+        if (Object.Axis >= 0)
+        {
+            Axis = Object.Axis;
+            PartitionObjects(References, Object, CentroidBounds, Left, Right);
+        }
+        else
+        {
+            // All the centroids are at the same place
+            Left.assign(References.begin(), References.begin() + Count / 2);
+            Right.assign(References.begin() + Count / 2, References.end());
+        }
+    }
+
+    // The parent references are not needed any more while the children build
+    std::vector<Reference>().swap(References);
+
+    const uint32_t LeftIndex = static_cast<uint32_t>(Result.Nodes.size());
+    Result.Nodes.emplace_back();
+    Result.Nodes.emplace_back();
+    Result.Nodes[NodeIndex].Children[0] = LeftIndex;
+    Result.Nodes[NodeIndex].Children[1] = LeftIndex + 1;
+    Result.Nodes[NodeIndex].SplitAxis = Axis;
+
+    BuildNode(LeftIndex, Left, Depth + 1);
+    BuildNode(LeftIndex + 1, Right, Depth + 1);
+}
+
+SBVHBuilder::ObjectSplit SBVHBuilder::FindObjectSplit(const std::vector<Reference>& References, const AABB& CentroidBounds, float NodeArea) const
+{
+    struct Bin
+    {
+        AABB Bounds = AABB::Empty();
+        uint32_t Count = 0;
+    };
+
+    const int BinsNum = Options.BinsNum;
+    ObjectSplit Best;
+    std::vector<Bin> Bins(BinsNum);
+    std::vector<AABB> RightBounds(BinsNum);
+    std::vector<uint32_t> RightCounts(BinsNum);
+
+    for (int Axis = 0; Axis < 3; ++Axis)
+    {
+        if (CentroidBounds.Max()[Axis] <= CentroidBounds.Min()[Axis])
+        {
+            continue;
+        }
+
+        std::fill(Bins.begin(), Bins.end(), Bin());
+        for (const Reference& Ref : References)
+        {
+            Bin& Target = Bins[CentroidBin(Ref.Bounds.Centroid(), Axis, CentroidBounds)];
+            Target.Bounds.Expand(Ref.Bounds);
+            Target.Count++;
+        }
+
+        AABB Accumulated = AABB::Empty();
+        uint32_t AccumulatedCount = 0;
+        for (int b = BinsNum - 1; b > 0; --b)
+        {
+            Accumulated.Expand(Bins[b].Bounds);
+            AccumulatedCount += Bins[b].Count;
+            RightBounds[b - 1] = Accumulated;
+            RightCounts[b - 1] = AccumulatedCount;
+        }
+
+        AABB LeftBounds = AABB::Empty();
+        uint32_t LeftCount = 0;
+        for (int b = 0; b < BinsNum - 1; ++b)
+        {
+            LeftBounds.Expand(Bins[b].Bounds);
+            LeftCount += Bins[b].Count;
+            if (LeftCount == 0 || RightCounts[b] == 0)
+            {
+                continue;
+            }
+
+            float Cost = Options.TraversalCost + Options.IntersectionCost
+                       * (LeftBounds.SurfaceArea() * LeftCount + RightBounds[b].SurfaceArea() * RightCounts[b]) / NodeArea;
+            if (Cost < Best.Cost)
+            {
+                Best.Axis = Axis;
+                Best.BinIndex = b;
+                Best.Cost = Cost;
+                Best.LeftBounds = LeftBounds;
+                Best.RightBounds = RightBounds[b];
+            }
+        }
+    }
+
+    return Best;
+}
+
+SBVHBuilder::SpatialSplit SBVHBuilder::FindSpatialSplit(const std::vector<Reference>& References, const AABB& NodeBounds, float NodeArea) const
+{
+    struct Bin
+    {
+        AABB Bounds = AABB::Empty();
+        uint32_t Entries = 0;
+        uint32_t Exits = 0;
+    };
+
+    const int BinsNum = Options.BinsNum;
+    SpatialSplit Best;
+    std::vector<Bin> Bins(BinsNum);
+    std::vector<AABB> RightBounds(BinsNum);
+    std::vector<uint32_t> RightCounts(BinsNum);
+
+    for (int Axis = 0; Axis < 3; ++Axis)
+    {
+        const float Origin = NodeBounds.Min()[Axis];
+        const float BinWidth = (NodeBounds.Max()[Axis] - Origin) / BinsNum;
+        if (BinWidth <= 0.0f)
+        {
+            continue;
+        }
+
+        auto BinOf = [Origin, BinWidth, BinsNum](float Position)
+        {
+            return std::min(std::max(static_cast<int>((Position - Origin) / BinWidth), 0), BinsNum - 1);
+        };
+
+        // Every reference enters the first bin it overlaps and exits the last one,
+        // its box is clipped to every bin in between
+        std::fill(Bins.begin(), Bins.end(), Bin());
+        for (const Reference& Ref : References)
+        {
+            const int First = BinOf(Ref.Bounds.Min()[Axis]);
+            const int Last = BinOf(Ref.Bounds.Max()[Axis]);
+
+            AABB Rest = Ref.Bounds;
+            for (int b = First; b < Last; ++b)
+            {
+                const float Plane = Origin + (b + 1) * BinWidth;
+                Bins[b].Bounds.Expand(ClipBelow(Rest, Axis, Plane));
+                Rest = ClipAbove(Rest, Axis, Plane);
+            }
+            Bins[Last].Bounds.Expand(Rest);
+            Bins[First].Entries++;
+            Bins[Last].Exits++;
+        }
+
+        AABB Accumulated = AABB::Empty();
+        uint32_t AccumulatedCount = 0;
+        for (int b = BinsNum - 1; b > 0; --b)
+        {
+            Accumulated.Expand(Bins[b].Bounds);
+            AccumulatedCount += Bins[b].Exits;
+            RightBounds[b - 1] = Accumulated;
+            RightCounts[b - 1] = AccumulatedCount;
+        }
+
+        AABB LeftBounds = AABB::Empty();
+        uint32_t LeftCount = 0;
+        for (int b = 0; b < BinsNum - 1; ++b)
+        {
+            LeftBounds.Expand(Bins[b].Bounds);
+            LeftCount += Bins[b].Entries;
+            if (LeftCount == 0 || RightCounts[b] == 0)
+            {
+                continue;
+            }
+
+            float Cost = Options.TraversalCost + Options.IntersectionCost
+                       * (LeftBounds.SurfaceArea() * LeftCount + RightBounds[b].SurfaceArea() * RightCounts[b]) / NodeArea;
+            if (Cost < Best.Cost)
+            {
+                Best.Axis = Axis;
+                Best.Position = Origin + (b + 1) * BinWidth;
+                Best.Cost = Cost;
+            }
+        }
+    }
+
+    return Best;
+}
+
+void SBVHBuilder::PartitionObjects(
+    std::vector<Reference>& References, const ObjectSplit& Split, const AABB& CentroidBounds,
+    std::vector<Reference>& OutLeft, std::vector<Reference>& OutRight) const
+{
+    for (const Reference& Ref : References)
+    {
+        bool bLeft = CentroidBin(Ref.Bounds.Centroid(), Split.Axis, CentroidBounds) <= Split.BinIndex;
+        (bLeft ? OutLeft : OutRight).push_back(Ref);
+    }
+}
+
+void SBVHBuilder::PartitionSpatial(
+    std::vector<Reference>& References, const SpatialSplit& Split,
+    std::vector<Reference>& OutLeft, std::vector<Reference>& OutRight)
+{
+    const int Axis = Split.Axis;
+    const float Position = Split.Position;
+
+    AABB LeftBounds = AABB::Empty();
+    AABB RightBounds = AABB::Empty();
+    std::vector<size_t> Straddling;
+
+    for (size_t i = 0; i < References.size(); ++i)
+    {
+        const Reference& Ref = References[i];
+        if (Ref.Bounds.Max()[Axis] <= Position)
+        {
+            OutLeft.push_back(Ref);
+            LeftBounds.Expand(Ref.Bounds);
+        }
+        else if (Ref.Bounds.Min()[Axis] >= Position)
+        {
+            OutRight.push_back(Ref);
+            RightBounds.Expand(Ref.Bounds);
+        }
+        else
+        {
+            Straddling.push_back(i);
+        }
+    }
+
+    // Reference unsplitting: a straddling reference goes to one side only when
+    // that is cheaper than duplicating it, or when the budget is spent
+    for (size_t i : Straddling)
+    {
+        const Reference& Ref = References[i];
+        const AABB Below = ClipBelow(Ref.Bounds, Axis, Position);
+        const AABB Above = ClipAbove(Ref.Bounds, Axis, Position);
+
+        AABB LeftWithAll = LeftBounds;
+        LeftWithAll.Expand(Ref.Bounds);
+        AABB RightWithAll = RightBounds;
+        RightWithAll.Expand(Ref.Bounds);
+        AABB LeftWithBelow = LeftBounds;
+        LeftWithBelow.Expand(Below);
+        AABB RightWithAbove = RightBounds;
+        RightWithAbove.Expand(Above);
+
+        const float LeftNum = static_cast<float>(OutLeft.size());
+        const float RightNum = static_cast<float>(OutRight.size());
+        const float SplitCost = LeftWithBelow.SurfaceArea() * (LeftNum + 1.0f) + RightWithAbove.SurfaceArea() * (RightNum + 1.0f);
+        const float LeftCost = LeftWithAll.SurfaceArea() * (LeftNum + 1.0f) + RightBounds.SurfaceArea() * RightNum;
+        const float RightCost = LeftBounds.SurfaceArea() * LeftNum + RightWithAll.SurfaceArea() * (RightNum + 1.0f);
+
+        const bool bCanDuplicate = ReferencesNum < ReferencesBudget;
+        if (bCanDuplicate && SplitCost < LeftCost && SplitCost < RightCost)
+        {
+            OutLeft.push_back({ Below, Ref.Index });
+            OutRight.push_back({ Above, Ref.Index });
+            LeftBounds = LeftWithBelow;
+            RightBounds = RightWithAbove;
+            ReferencesNum++;
+        }
+        else if (LeftCost <= RightCost)
+        {
+            OutLeft.push_back(Ref);
+            LeftBounds = LeftWithAll;
+        }
+        else
+        {
+            OutRight.push_back(Ref);
+            RightBounds = RightWithAll;
+        }
+    }
+}
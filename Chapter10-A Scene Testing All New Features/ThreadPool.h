@@ -0,0 +1,308 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "CpuTopology.h"
+
+/// Long-lived pool of worker threads. Every worker owns a deque of tasks:
+/// it pops its own work from the back (LIFO, cache friendly) and, when it runs
+/// dry, steals from the front of the other workers' deques. Threads outside the
+/// pool (e.g. main) can submit work and help executing it while they wait.
+class ThreadPool
+{
+    public:
+        using Task = std::function<void()>;
+
+        /// @param InThreadsNum : number of workers, 0 means the CPUs the affinity mask
+        /// and the cgroup quota actually give us.
+        /// @param bPinThreads : pin every worker on its own CPU, filling one NUMA node
+        /// after the other. Per-thread buffers are first touched by their pinned
+        /// worker, so they end up on its node.
+        explicit ThreadPool(uint32_t InThreadsNum = 0, bool bPinThreads = false);
+        ~ThreadPool();
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        /// Queue a task. From a worker of this pool the task goes to the worker's
+        /// own deque, otherwise the deques are filled round-robin.
+        void Submit(Task InTask);
+
+        /// Execute one pending task on the calling thread.
+        /// @return false if no task could be found.
+        bool RunPendingTask();
+
+        inline uint32_t GetThreadsNum() const { return static_cast<uint32_t>(Workers.size()); }
+
+        /// Index of the calling thread in this pool, -1 if it is not one of its workers.
+        inline int GetWorkerIndex() const { return CurrentPool() == this ? CurrentWorkerIndex() : -1; }
+
+        /// Pool shared by the renderer, the BVH builder and scene setup.
+        static ThreadPool& Get();
+
+        /// Settings of the shared pool, must be called before the first Get().
+        static void Configure(uint32_t InThreadsNum, bool bPinThreads);
+
+    private:
+        struct WorkQueue
+        {
+            std::mutex Mutex;
+            std::deque<Task> Tasks;
+        };
+
+        void WorkerLoop(uint32_t Index, int PinnedCpu);
+
+        bool PopTask(uint32_t Index, Task& OutTask);
+        bool StealTask(uint32_t Thief, Task& OutTask);
+
+        static const ThreadPool*& CurrentPool()
+        {
+            static thread_local const ThreadPool* Pool = nullptr;
+            return Pool;
+        }
+
+        static int& CurrentWorkerIndex()
+        {
+            static thread_local int Index = -1;
+            return Index;
+        }
+
+        struct Config
+        {
+            uint32_t ThreadsNum = 0;
+            bool bPinThreads = false;
+            // Set once by the pool construction, Configure may read it from any thread
+            std::atomic<bool> bCreated{ false };
+        };
+
+        static Config& SharedConfig()
+        {
+            static Config SharedPoolConfig;
+            return SharedPoolConfig;
+        }
+
+    private:
+        std::vector<std::unique_ptr<WorkQueue>> Queues;
+        std::vector<std::thread> Workers;
+
+        std::atomic<int> PendingTasks;
+        std::atomic<uint32_t> NextQueue;
+
+        std::mutex SleepMutex;
+        std::condition_variable SleepCondition;
+        bool bStopping;
+};
+
+/// Set of tasks that can be waited on together. Waiting threads keep executing
+/// pending tasks of the pool, so a task may itself spawn and wait on a group.
+class TaskGroup
+{
+    public:
+        explicit TaskGroup(ThreadPool& InPool = ThreadPool::Get()) : Pool(InPool), Outstanding(0) {}
+        ~TaskGroup() { Wait(); }
+
+        TaskGroup(const TaskGroup&) = delete;
+        TaskGroup& operator=(const TaskGroup&) = delete;
+
+        void Run(ThreadPool::Task InTask)
+        {
+            Outstanding.fetch_add(1, std::memory_order_relaxed);
+            Pool.Submit([this, InTask]()
+            {
+                InTask();
+                Outstanding.fetch_sub(1, std::memory_order_release);
+            });
+        }
+
+        void Wait()
+        {
+            while (Outstanding.load(std::memory_order_acquire) > 0)
+            {
+                if (!Pool.RunPendingTask())
+                {
+                    std::this_thread::yield();
+                }
+            }
+        }
+
+    private:
+        ThreadPool& Pool;
+        std::atomic<int> Outstanding;
+};
+
+ThreadPool::ThreadPool(uint32_t InThreadsNum, bool bPinThreads)
+    : PendingTasks(0)
+    , NextQueue(0)
+    , bStopping(false)
+{
+    const CpuTopology Topology = CpuTopology::Detect();
+    uint32_t ThreadsNum = InThreadsNum != 0 ? InThreadsNum : Topology.GetEffectiveThreadsNum();
+
+    for (uint32_t i = 0; i < ThreadsNum; ++i)
+    {
+        Queues.emplace_back(new WorkQueue());
+    }
+
+    for (uint32_t i = 0; i < ThreadsNum; ++i)
+    {
+        int PinnedCpu = bPinThreads ? Topology.Cpus[i % Topology.Cpus.size()] : -1;
+        Workers.emplace_back(&ThreadPool::WorkerLoop, this, i, PinnedCpu);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> Lock(SleepMutex);
+        bStopping = true;
+    }
+    SleepCondition.notify_all();
+
+    for (auto& Worker : Workers)
+    {
+        Worker.join();
+    }
+}
+
+void ThreadPool::Submit(Task InTask)
+{
+    int WorkerIndex = GetWorkerIndex();
+    uint32_t QueueIndex = WorkerIndex >= 0
+        ? static_cast<uint32_t>(WorkerIndex)
+        : NextQueue.fetch_add(1, std::memory_order_relaxed) % GetThreadsNum();
+
+    {
+        std::lock_guard<std::mutex> Lock(Queues[QueueIndex]->Mutex);
+        Queues[QueueIndex]->Tasks.push_back(std::move(InTask));
+        PendingTasks.fetch_add(1, std::memory_order_release);
+    }
+
+    // Taking the sleep mutex orders us after any worker that is about to wait,
+    // so the notification cannot be lost.
+    {
+        std::lock_guard<std::mutex> Lock(SleepMutex);
+    }
+    SleepCondition.notify_one();
+}
+
+bool ThreadPool::RunPendingTask()
+{
+    Task PendingTask;
+    int WorkerIndex = GetWorkerIndex();
+
+    bool bFound = WorkerIndex >= 0
+        ? PopTask(static_cast<uint32_t>(WorkerIndex), PendingTask)
+        : StealTask(NextQueue.load(std::memory_order_relaxed) % GetThreadsNum(), PendingTask);
+
+    if (!bFound)
+    {
+        return false;
+    }
+
+    PendingTask();
+    return true;
+}
+
+void ThreadPool::WorkerLoop(uint32_t Index, int PinnedCpu)
+{
+    if (PinnedCpu >= 0 && !PinCurrentThread(PinnedCpu))
+    {
+        std::cerr << "Cannot pin worker " << Index << " on CPU " << PinnedCpu << ".\n";
+    }
+
+    CurrentPool() = this;
+    CurrentWorkerIndex() = static_cast<int>(Index);
+
+    while (true)
+    {
+        Task PendingTask;
+        if (PopTask(Index, PendingTask))
+        {
+            PendingTask();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> Lock(SleepMutex);
+        SleepCondition.wait(Lock, [this]()
+        {
+            return bStopping || PendingTasks.load(std::memory_order_acquire) > 0;
+        });
+
+        if (bStopping && PendingTasks.load(std::memory_order_acquire) <= 0)
+        {
+            return;
+        }
+    }
+}
+
+bool ThreadPool::PopTask(uint32_t Index, Task& OutTask)
+{
+    {
+        WorkQueue& Queue = *Queues[Index];
+        std::lock_guard<std::mutex> Lock(Queue.Mutex);
+        if (!Queue.Tasks.empty())
+        {
+            OutTask = std::move(Queue.Tasks.back());
+            Queue.Tasks.pop_back();
+            PendingTasks.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+
+    return StealTask(Index, OutTask);
+}
+
+bool ThreadPool::StealTask(uint32_t Thief, Task& OutTask)
+{
+    const uint32_t QueuesNum = static_cast<uint32_t>(Queues.size());
+
+    for (uint32_t Offset = 1; Offset <= QueuesNum; ++Offset)
+    {
+        WorkQueue& Victim = *Queues[(Thief + Offset) % QueuesNum];
+        std::lock_guard<std::mutex> Lock(Victim.Mutex);
+        if (!Victim.Tasks.empty())
+        {
+            OutTask = std::move(Victim.Tasks.front());
+            Victim.Tasks.pop_front();
+            PendingTasks.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+ThreadPool& ThreadPool::Get()
+{
+    // Marked created by the first call only, inside the thread safe static initialization
+    static const Config& SharedPoolConfig = []() -> const Config&
+    {
+        Config& CreatedConfig = SharedConfig();
+        CreatedConfig.bCreated = true;
+        return CreatedConfig;
+    }();
+
+    static ThreadPool Pool(SharedPoolConfig.ThreadsNum, SharedPoolConfig.bPinThreads);
+    return Pool;
+}
+
+void ThreadPool::Configure(uint32_t InThreadsNum, bool bPinThreads)
+{
+    Config& SharedPoolConfig = SharedConfig();
+    if (SharedPoolConfig.bCreated)
+    {
+        std::cerr << "ThreadPool::Configure called after the shared pool was created, ignored.\n";
+        return;
+    }
+
+    SharedPoolConfig.ThreadsNum = InThreadsNum;
+    SharedPoolConfig.bPinThreads = bPinThreads;
+}
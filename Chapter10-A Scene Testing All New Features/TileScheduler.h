@@ -0,0 +1,196 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "RTWeekend.h"
+#include "ThreadPool.h"
+
+// Order in which the tiles are handed out to the workers.
+enum class TileOrder
+{
+    Scanline,   // row by row
+    Morton,     // Z-order curve
+    Hilbert,    // Hilbert curve, neighbouring tiles stay neighbours
+    Spiral      // rings around the image centre, centre first
+};
+
+// Pixel rectangle [X0, X1) x [Y0, Y1), with j = 0 being the bottom row like in the camera.
+struct Tile
+{
+    int X0, Y0;
+    int X1, Y1;
+
+    inline int Width() const { return X1 - X0; }
+    inline int Height() const { return Y1 - Y0; }
+    inline int PixelNums() const { return Width() * Height(); }
+};
+
+/// Cuts the image into small square tiles and hands them out through an atomic
+/// counter, so workers pull the next tile as soon as they are done with theirs.
+class TileScheduler
+{
+    public:
+        TileScheduler(int InImageWidth, int InImageHeight, int InTileSize = 16, TileOrder InOrder = TileOrder::Hilbert);
+
+        /// Grab the next tile to render. Thread safe.
+        /// @return false once every tile has been handed out.
+        inline bool NextTile(Tile& OutTile)
+        {
+            size_t Index = NextIndex.fetch_add(1, std::memory_order_relaxed);
+            if (Index >= Tiles.size())
+            {
+                return false;
+            }
+
+            OutTile = Tiles[Index];
+            return true;
+        }
+
+        /// Hand the tiles out again from the first one.
+        inline void Reset() { NextIndex.store(0, std::memory_order_relaxed); }
+
+        inline size_t GetTileNums() const { return Tiles.size(); }
+        inline const std::vector<Tile>& GetTiles() const { return Tiles; }
+
+        /// Run Functor on every tile, one tile puller per worker of the ThreadPool.
+        void Dispatch(const std::function<void (const Tile& InTile)>& Functor, ThreadPool& Pool = ThreadPool::Get());
+
+    private:
+        static uint32_t MortonIndex(uint32_t x, uint32_t y);
+        static uint32_t HilbertIndex(uint32_t GridSize, uint32_t x, uint32_t y);
+
+    private:
+        std::vector<Tile> Tiles;
+        std::atomic<size_t> NextIndex;
+};
+
+TileScheduler::TileScheduler(int InImageWidth, int InImageHeight, int InTileSize, TileOrder InOrder)
+    : NextIndex(0)
+{
+    const int TileSize = std::max(1, InTileSize);
+    const int TilesX = (InImageWidth + TileSize - 1) / TileSize;
+    const int TilesY = (InImageHeight + TileSize - 1) / TileSize;
+
+    uint32_t GridSize = 1;
+    while (GridSize < static_cast<uint32_t>(std::max(TilesX, TilesY)))
+    {
+        GridSize <<= 1;
+    }
+
+    struct OrderedTile
+    {
+        Tile Bounds;
+        float Key;
+    };
+    std::vector<OrderedTile> OrderedTiles;
+    OrderedTiles.reserve(TilesX * TilesY);
+
+    const float CenterX = 0.5f * (TilesX - 1);
+    const float CenterY = 0.5f * (TilesY - 1);
+
+    for (int ty = 0; ty < TilesY; ++ty)
+    {
+        for (int tx = 0; tx < TilesX; ++tx)
+        {
+            OrderedTile Ordered;
+            Ordered.Bounds.X0 = tx * TileSize;
+            Ordered.Bounds.Y0 = ty * TileSize;
+            Ordered.Bounds.X1 = std::min(Ordered.Bounds.X0 + TileSize, InImageWidth);
+            Ordered.Bounds.Y1 = std::min(Ordered.Bounds.Y0 + TileSize, InImageHeight);
+
+            switch (InOrder)
+            {
+                case TileOrder::Scanline:
+                    // Top row first, the image is written top to bottom
+                    Ordered.Key = static_cast<float>((TilesY - 1 - ty) * TilesX + tx);
+                    break;
+                case TileOrder::Morton:
+                    Ordered.Key = static_cast<float>(MortonIndex(tx, ty));
+                    break;
+                case TileOrder::Hilbert:
+                    Ordered.Key = static_cast<float>(HilbertIndex(GridSize, tx, ty));
+                    break;
+                case TileOrder::Spiral:
+                {
+                    // Ring index first, then the angle inside the ring
+                    float dx = tx - CenterX;
+                    float dy = ty - CenterY;
+                    float Ring = std::floor(std::max(std::fabs(dx), std::fabs(dy)));
+                    float Angle = std::atan2(dy, dx) + PI;
+                    Ordered.Key = Ring * 8.0f + Angle;
+                    break;
+                }
+            }
+
+            OrderedTiles.push_back(Ordered);
+        }
+    }
+
+    std::stable_sort(OrderedTiles.begin(), OrderedTiles.end(),
+        [](const OrderedTile& a, const OrderedTile& b) { return a.Key < b.Key; });
+
+    Tiles.reserve(OrderedTiles.size());
+    for (const auto& Ordered : OrderedTiles)
+    {
+        Tiles.push_back(Ordered.Bounds);
+    }
+}
+
+void TileScheduler::Dispatch(const std::function<void (const Tile& InTile)>& Functor, ThreadPool& Pool)
+{
+    Reset();
+
+    TaskGroup Group(Pool);
+    for (uint32_t i = 0; i < Pool.GetThreadsNum(); ++i)
+    {
+        Group.Run([this, &Functor]()
+        {
+            Tile CurrentTile;
+            while (NextTile(CurrentTile))
+            {
+                Functor(CurrentTile);
+            }
+        });
+    }
+
+    Group.Wait();
+}
+
+uint32_t TileScheduler::MortonIndex(uint32_t x, uint32_t y)
+{
+    uint32_t Index = 0;
+    for (uint32_t Bit = 0; Bit < 16; ++Bit)
+    {
+        Index |= ((x >> Bit) & 1u) << (2 * Bit);
+        Index |= ((y >> Bit) & 1u) << (2 * Bit + 1);
+    }
+    return Index;
+}
+
+uint32_t TileScheduler::HilbertIndex(uint32_t GridSize, uint32_t x, uint32_t y)
+{
+    uint32_t Index = 0;
+    for (uint32_t s = GridSize / 2; s > 0; s /= 2)
+    {
+        uint32_t rx = (x & s) > 0 ? 1 : 0;
+        uint32_t ry = (y & s) > 0 ? 1 : 0;
+        Index += s * s * ((3 * rx) ^ ry);
+
+        // Rotate the quadrant
+        if (ry == 0)
+        {
+            if (rx == 1)
+            {
+                x = GridSize - 1 - x;
+                y = GridSize - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return Index;
+}
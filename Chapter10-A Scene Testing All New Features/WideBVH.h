@@ -0,0 +1,385 @@
+#pragma once
+
+#include "RTWeekend.h"
+
+#include "BVHBuilders.h"
+#include "Hittable.h"
+#include "HittableList.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+    #include <immintrin.h>
+    #define RT_WIDE_BVH_SSE 1
+#endif
+
+#if defined(__AVX__)
+    #define RT_WIDE_BVH_AVX 1
+#endif
+
+/// Node with up to Width children, their boxes stored as structure of arrays so
+/// one ray is tested against all of them at once.
+///
+/// A child is a node when Counts[i] == 0 and Children[i] >= 0, a leaf of Counts[i]
+/// primitives starting at Children[i] otherwise. Unused slots have an empty box
+/// and Children[i] == -1.
+template<int Width>
+struct alignas(32) WideBVHNode
+{
+    float BoundsMin[3][Width];
+    float BoundsMax[3][Width];
+    int32_t Children[Width];
+    uint16_t Counts[Width];
+};
+
+/// Children of the wide node made of the binary subtree under BuildIndex: the
+/// interior child with the largest area is opened until there are MaxChildren of
+/// them, that is the one most rays would otherwise have to descend into. A leaf
+/// gives a single child, itself.
+inline void CollapseChildren(const BVHBuildResult& Build, uint32_t BuildIndex, int MaxChildren, std::vector<uint32_t>& OutSlots)
+{
+    OutSlots.clear();
+
+    const BVHBuildNode& Source = Build.Nodes[BuildIndex];
+    if (Source.IsLeaf())
+    {
+        OutSlots.push_back(BuildIndex);
+    }
+    else
+    {
+        OutSlots.push_back(Source.Children[0]);
+        OutSlots.push_back(Source.Children[1]);
+    }
+
+    while (OutSlots.size() < static_cast<size_t>(MaxChildren))
+    {
+        int Largest = -1;
+        float LargestArea = -1.0f;
+        for (size_t i = 0; i < OutSlots.size(); ++i)
+        {
+            const BVHBuildNode& Candidate = Build.Nodes[OutSlots[i]];
+            if (!Candidate.IsLeaf() && Candidate.Bounds.SurfaceArea() > LargestArea)
+            {
+                Largest = static_cast<int>(i);
+                LargestArea = Candidate.Bounds.SurfaceArea();
+            }
+        }
+
+        if (Largest < 0)
+        {
+            break;
+        }
+
+        const BVHBuildNode& Opened = Build.Nodes[OutSlots[Largest]];
+        OutSlots[Largest] = Opened.Children[0];
+        OutSlots.push_back(Opened.Children[1]);
+    }
+}
+
+/// BVH with 4 (QBVH) or 8 (OBVH) children per node, built by collapsing the binary
+/// SAH tree of BVHBuilder. The children boxes are tested with SSE (4) or AVX (8)
+/// when the compiler targets them, with plain loops otherwise.
+template<int Width>
+class WideBVH : public Hittable
+{
+    static_assert(Width == 4 || Width == 8, "WideBVH supports 4 or 8 children per node");
+
+    public:
+        // Worst case: every level of a 64 levels deep tree pushes all but one child
+        static const int StackSize = 64 * (Width - 1) + 1;
+
+        WideBVH(const HittableList& List, float Time0, float Time1, const BVHBuildOptions& Options = BVHBuildOptions())
+            : WideBVH(List.Objects, 0, List.Objects.size(), Time0, Time1, Options)
+        {}
+
+        WideBVH(
+            const std::vector<shared_ptr<Hittable>>& SrcObjects,
+            size_t Start, size_t End, float Time0, float Time1,
+            const BVHBuildOptions& Options = BVHBuildOptions());
+
+        virtual bool Hit(const Ray& InRay, float tMin, float tMax, HitRecord& Record) const override;
+
+        virtual bool BoundingBox(float InTime0, float InTime1, AABB& OutputBox) const override;
+
+        inline const std::vector<WideBVHNode<Width>>& GetNodes() const { return Nodes; }
+
+        /// Nodes and primitive references, not the primitives themselves.
+        inline size_t GetMemoryBytes() const
+        {
+            return Nodes.size() * sizeof(WideBVHNode<Width>) + Primitives.size() * sizeof(shared_ptr<Hittable>);
+        }
+
+    private:
+        struct StackEntry
+        {
+            int32_t Child;
+            uint16_t Count;
+            float tEntry;
+        };
+
+        /// Append the node made of the binary subtree under BuildIndex, returns its index.
+        int32_t Collapse(const BVHBuildResult& Build, uint32_t BuildIndex, int NodeDepth);
+
+        /// Entry distance of the ray in every child box, returns the mask of the children hit.
+        static int IntersectChildren(
+            const WideBVHNode<Width>& Node, const float Origin[3], const float InvDir[3],
+            const int NearSide[3], float tMin, float tMax, float OutEntries[Width]);
+
+    private:
+        std::vector<WideBVHNode<Width>> Nodes;
+        std::vector<shared_ptr<Hittable>> Primitives;
+        AABB Box;
+        int Depth = 0;
+};
+
+using QBVH = WideBVH<4>;
+using OBVH = WideBVH<8>;
+
+template<int Width>
+WideBVH<Width>::WideBVH(
+    const std::vector<shared_ptr<Hittable>>& SrcObjects,
+    size_t Start, size_t End, float Time0, float Time1,
+    const BVHBuildOptions& Options)
+{
+    std::vector<AABB> PrimitiveBounds;
+    CollectPrimitiveBounds(SrcObjects, Start, End, Time0, Time1, PrimitiveBounds, Options.bParallel);
+
+    BVHBuildOptions WideOptions = Options;
+    WideOptions.MaxLeafSize = std::min(WideOptions.MaxLeafSize, 0xFFFF);
+    BVHBuildResult Build = BuildBVH(PrimitiveBounds, WideOptions);
+
+    if (Build.IsEmpty())
+    {
+        std::cerr << "No object in WideBVH constructor.\n";
+        return;
+    }
+
+    Primitives.reserve(Build.PrimitiveIndices.size());
+    for (uint32_t Index : Build.PrimitiveIndices)
+    {
+        Primitives.push_back(SrcObjects[Start + Index]);
+    }
+
+    Nodes.reserve(Build.Nodes.size() / (Width - 1) + 1);
+    Collapse(Build, 0, 1);
+    Box = Build.Nodes[0].Bounds;
+}
+
+template<int Width>
+int32_t WideBVH<Width>::Collapse(const BVHBuildResult& Build, uint32_t BuildIndex, int NodeDepth)
+{
+    Depth = std::max(Depth, NodeDepth);
+
+    std::vector<uint32_t> Slots;
+    CollapseChildren(Build, BuildIndex, Width, Slots);
+
+    const int32_t NodeIndex = static_cast<int32_t>(Nodes.size());
+    Nodes.emplace_back();
+
+    for (int i = 0; i < Width; ++i)
+    {
+        WideBVHNode<Width>& Node = Nodes[NodeIndex];
+        if (i >= static_cast<int>(Slots.size()))
+        {
+            for (int a = 0; a < 3; ++a)
+            {
+                Node.BoundsMin[a][i] = Infinity;
+                Node.BoundsMax[a][i] = -Infinity;
+            }
+            Node.Children[i] = -1;
+            Node.Counts[i] = 0;
+            continue;
+        }
+
+        const BVHBuildNode& Child = Build.Nodes[Slots[i]];
+        for (int a = 0; a < 3; ++a)
+        {
+            Node.BoundsMin[a][i] = Child.Bounds.Min()[a];
+            Node.BoundsMax[a][i] = Child.Bounds.Max()[a];
+        }
+
+        if (Child.IsLeaf())
+        {
+            Node.Children[i] = static_cast<int32_t>(Child.PrimitivesOffset);
+            Node.Counts[i] = static_cast<uint16_t>(Child.PrimitiveCount);
+        }
+        else
+        {
+            // Nodes may reallocate, index it again after the recursion
+            int32_t ChildIndex = Collapse(Build, Slots[i], NodeDepth + 1);
+            Nodes[NodeIndex].Children[i] = ChildIndex;
+            Nodes[NodeIndex].Counts[i] = 0;
+        }
+    }
+
+    return NodeIndex;
+}
+
+template<int Width>
+int WideBVH<Width>::IntersectChildren(
+    const WideBVHNode<Width>& Node, const float Origin[3], const float InvDir[3],
+    const int NearSide[3], float tMin, float tMax, float OutEntries[Width])
+{
+    // The near plane of every axis is the min or the max one depending on the
+    // direction sign, picked once per ray instead of a min/max per child
+    const float* Planes[2][3] = {
+        { Node.BoundsMin[0], Node.BoundsMin[1], Node.BoundsMin[2] },
+        { Node.BoundsMax[0], Node.BoundsMax[1], Node.BoundsMax[2] }
+    };
+
+#if defined(RT_WIDE_BVH_AVX)
+    if (Width == 8)
+    {
+        __m256 Entry = _mm256_set1_ps(tMin);
+        __m256 Exit = _mm256_set1_ps(tMax);
+        for (int a = 0; a < 3; ++a)
+        {
+            const __m256 O = _mm256_set1_ps(Origin[a]);
+            const __m256 I = _mm256_set1_ps(InvDir[a]);
+            const __m256 Near = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(Planes[NearSide[a]][a]), O), I);
+            const __m256 Far = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(Planes[1 - NearSide[a]][a]), O), I);
+            // NaN (origin on a slab of a flat direction) keeps the current bound, like AABB::Hit
+            Entry = _mm256_max_ps(Near, Entry);
+            Exit = _mm256_min_ps(Far, Exit);
+        }
+        _mm256_storeu_ps(OutEntries, Entry);
+        return _mm256_movemask_ps(_mm256_cmp_ps(Entry, Exit, _CMP_LT_OQ));
+    }
+#endif
+
+#if defined(RT_WIDE_BVH_SSE)
+    {
+        // 4 children per SSE register, twice for 8 wide nodes without AVX
+        int Mask = 0;
+        for (int Lane = 0; Lane < Width; Lane += 4)
+        {
+            __m128 Entry = _mm_set1_ps(tMin);
+            __m128 Exit = _mm_set1_ps(tMax);
+            for (int a = 0; a < 3; ++a)
+            {
+                const __m128 O = _mm_set1_ps(Origin[a]);
+                const __m128 I = _mm_set1_ps(InvDir[a]);
+                const __m128 Near = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(Planes[NearSide[a]][a] + Lane), O), I);
+                const __m128 Far = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(Planes[1 - NearSide[a]][a] + Lane), O), I);
+                Entry = _mm_max_ps(Near, Entry);
+                Exit = _mm_min_ps(Far, Exit);
+            }
+            _mm_storeu_ps(OutEntries + Lane, Entry);
+            Mask |= _mm_movemask_ps(_mm_cmplt_ps(Entry, Exit)) << Lane;
+        }
+        return Mask;
+    }
+#else
+    int Mask = 0;
+    for (int i = 0; i < Width; ++i)
+    {
+        float Entry = tMin;
+        float Exit = tMax;
+        for (int a = 0; a < 3; ++a)
+        {
+            float Near = (Planes[NearSide[a]][a][i] - Origin[a]) * InvDir[a];
+            float Far = (Planes[1 - NearSide[a]][a][i] - Origin[a]) * InvDir[a];
+            Entry = Near > Entry ? Near : Entry;
+            Exit = Far < Exit ? Far : Exit;
+        }
+        OutEntries[i] = Entry;
+        Mask |= (Entry < Exit ? 1 : 0) << i;
+    }
+    return Mask;
+#endif
+}
+
+template<int Width>
+bool WideBVH<Width>::Hit(const Ray& InRay, float tMin, float tMax, HitRecord& Record) const
+{
+    if (Nodes.empty())
+    {
+        return false;
+    }
+
+    const float Origin[3] = { InRay.Origin[0], InRay.Origin[1], InRay.Origin[2] };
+    const float InvDir[3] = { 1.0f / InRay.Dir[0], 1.0f / InRay.Dir[1], 1.0f / InRay.Dir[2] };
+    const int NearSide[3] = { InvDir[0] < 0.0f, InvDir[1] < 0.0f, InvDir[2] < 0.0f };
+
+    // Degenerate trees deeper than the stack kept on the frame get one sized from their depth
+    StackEntry LocalStack[StackSize];
+    std::vector<StackEntry> DeepStack;
+    StackEntry* Stack = LocalStack;
+    if ((Width - 1) * Depth + 1 > StackSize)
+    {
+        DeepStack.resize((Width - 1) * Depth + 1);
+        Stack = DeepStack.data();
+    }
+    int StackTop = 0;
+    Stack[StackTop++] = { 0, 0, tMin };
+
+    HitRecord TempRecord;
+    bool bHitAnything = false;
+
+    while (StackTop > 0)
+    {
+        const StackEntry Entry = Stack[--StackTop];
+
+        // Entered behind the closest hit found since it was pushed
+        if (Entry.tEntry >= tMax)
+        {
+            continue;
+        }
+
+        RT_BVH_STAT(CountNodes(1));
+        if (Entry.Count > 0)
+        {
+            RT_BVH_STAT(CountPrimitives(Entry.Count));
+            for (int i = 0; i < Entry.Count; ++i)
+            {
+                if (Primitives[Entry.Child + i]->Hit(InRay, tMin, tMax, TempRecord))
+                {
+                    bHitAnything = true;
+                    tMax = TempRecord.t;
+                    Record = TempRecord;
+                }
+            }
+            continue;
+        }
+
+        const WideBVHNode<Width>& Node = Nodes[Entry.Child];
+        alignas(32) float Entries[Width];
+        // All the slots are tested at once, empty ones included
+        RT_BVH_STAT(CountBoxes(Width));
+        int Mask = IntersectChildren(Node, Origin, InvDir, NearSide, tMin, tMax, Entries);
+
+        // Push the children hit far to near, the nearest is popped first
+        StackEntry Hits[Width];
+        int HitsNum = 0;
+        for (int i = 0; i < Width; ++i)
+        {
+            if (Mask & (1 << i))
+            {
+                StackEntry Child = { Node.Children[i], Node.Counts[i], Entries[i] };
+                int j = HitsNum++;
+                while (j > 0 && Hits[j - 1].tEntry < Child.tEntry)
+                {
+                    Hits[j] = Hits[j - 1];
+                    --j;
+                }
+                Hits[j] = Child;
+            }
+        }
+
+        for (int i = 0; i < HitsNum; ++i)
+        {
+            Stack[StackTop++] = Hits[i];
+        }
+    }
+
+    return bHitAnything;
+}
+
+template<int Width>
+bool WideBVH<Width>::BoundingBox(float InTime0, float InTime1, AABB& OutputBox) const
+{
+    OutputBox = Box;
+    return !Nodes.empty();
+}